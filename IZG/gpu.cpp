@@ -6,10 +6,76 @@
  */
 
 #include <student/gpu.hpp>
+#include <student/gpuExt.hpp>
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cmath>
+#include <condition_variable>
+#include <cstring>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <shared_mutex>
+#include <thread>
+#include <utility>
+#include <vector>
+
+// 8 pixelu najednou pres AVX2, dostupnost instrukci se overuje za behu
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+  #include <immintrin.h>
+  #define IZG_AVX2 1
+  #define IZG_TARGET_AVX2 __attribute__((target("avx2")))
+#elif defined(_MSC_VER) && defined(_M_X64)
+  #include <immintrin.h>
+  #include <intrin.h>
+  #define IZG_AVX2 1
+  #define IZG_TARGET_AVX2
+#else
+  #define IZG_AVX2 0
+#endif
 
 #define MIN(a,b) (a < b ? (a) : (b))
 #define MAX(a,b) (a > b ? (a) : (b))
 
+// Presnost souradnic vrcholu pri rasterizaci: 1/256 pixelu
+int32_t const subpixelBits = 8;
+int64_t const subpixelOne  = 1 << subpixelBits;
+// Maximalni velikost souradnice v subpixelech - soucin dvou souradnic se musi vejit do int64
+int64_t const subpixelLimit = int64_t(1) << 29;
+
+// Orezany trojuhelnik (near rovina + 4 roviny guard bandu) ma nejvyse 9 vrcholu --> 7 trojuhelniku
+uint32_t const maxClippedVertices = 9;
+
+// Kernely interpolace se generuji pro vsechna rozlozeni varyingu ve slotech 0..3 (EMPTY, FLOAT, VEC2, VEC3, VEC4)
+uint32_t const varyingKernelSlots   = 4;
+uint32_t const varyingKernelTypes   = 5;
+uint32_t const varyingKernelLayouts = 5 * 5 * 5 * 5;
+
+// Nejvetsi pixel barvy, ktery se cisti vyplnenim vzorem
+uint32_t const maxPixelBytes = 16;
+// Cisteni po blocich radku, kazdy blok je samostatna uloha
+uint32_t const clearRows = 16;
+
+// Bity odlozeneho cisteni dlazdice
+uint8_t const clearColorBit = 1;
+uint8_t const clearDepthBit = 2;
+
+// Textury nahrane pres izg_uploadTexture: dlazdice 8x8 texelu, uvnitr dlazdice Mortonovo poradi
+uint32_t const textureTileBits  = 3;
+uint32_t const maxTextureLevels = 16;
+// Cache dekomprimovanych bloku textur (v kazdem vlakne)
+uint32_t const blockCacheSize   = 64;
+
+// Velikost bloku hierarchicke hloubky v pixelech
+int const hiZBlock = 8;
+// Vetsi trojuhelniky se cele netestuji, odmitaji se az po blocich pri rasterizaci
+uint32_t const hiZMaxTriangleBlocks = 64;
+// Pocet command bufferu, ktere mohou cekat na vlakno vykreslovani (izg_submit)
+uint32_t const submitRingSize = 4;
+
 struct Primitive{
   OutVertex vertex[3];
 };
@@ -21,53 +87,511 @@ struct Barycentric{
   float lambda2;
 };
 
-void indexing(GPUMemory& mem, uint32_t i, InVertex& inVertex){
-  int32_t bufferID =  mem.vertexArrays[mem.activatedVertexArray].indexBufferID;
-  IndexType type = mem.vertexArrays[mem.activatedVertexArray].indexType;
-  uint64_t offset = mem.vertexArrays[mem.activatedVertexArray].indexOffset;
+/// Mip uroven nahrane textury
+struct TextureLevel{
+  uint32_t width;
+  uint32_t height;
+  uint32_t tilesX;
+  uint64_t offset;  // prvni texel urovne
+};
 
-  // Indexing
-  if(bufferID == -1)
-    inVertex.gl_VertexID = i;
-  else {
-    if(type == IndexType::UINT8){
-      uint8_t* index = (uint8_t*)((uint8_t*) mem.buffers[bufferID].data + offset);
-      inVertex.gl_VertexID = (uint8_t) index[i];
-    }
+/// Kanonicke formaty texelu nahranych textur: UINT8 zdroje --> RGBA8 (R v nejnizsim bajtu), FLOAT32 --> RGBA32F
+using TexelRGBA8   = uint32_t;
+using TexelRGBA32F = glm::vec4;
 
-    if(type == IndexType::UINT16){
-      uint16_t* index = (uint16_t*)((uint8_t*) mem.buffers[bufferID].data + offset);
-      inVertex.gl_VertexID = (uint16_t) index[i];
-    }
+/// Komprimovane bloky 4x4 texelu (16 po sobe jdoucich texelu Mortonova poradi)
+struct TexelBC1{
+  uint8_t color[8];   // 2 barvy RGB565 + 2 bitove indexy, bez alfy (nepruhledne textury)
+};
+
+struct TexelBC3{
+  uint8_t alpha[8];   // 2 alfy + 3 bitove indexy
+  uint8_t color[8];   // jako BC1, vzdy 4 barvy
+};
+
+enum class TexelFormat : uint8_t{
+  RGBA8,
+  RGBA32F,
+  BC1,
+  BC3,
+};
+
+/// Popis nahrane textury
+struct TextureStorage{
+  TexelFormat   format;
+  uint64_t      upload;   // poradove cislo nahrani (klic cache bloku, adresa se muze opakovat)
+  TextureFilter filter;
+  uint32_t      nofLevels;
+  TextureLevel  levels[maxTextureLevels];
+};
+
+/// Registr zivych nahranych textur podle Image::data, cte ho i vlakno provadejici odeslane command buffery
+struct TextureRegistry{
+  std::shared_mutex                            mutex;
+  std::map<void const*, TextureStorage const*> textures;
+  std::atomic<uint64_t>                        version{1}; // zvysi se pri kazde zmene (platnost cache vlaken)
+};
+
+TextureRegistry textureRegistry;
+
+/// Pamet nahrane textury, po dobu sve existence je zapsana v registru
+struct UploadedTexture{
+  TextureStorage       header;
+  std::vector<uint8_t> texels;
+
+  UploadedTexture(TextureStorage const& storageHeader, size_t size) : header(storageHeader), texels(size){
+    std::unique_lock<std::shared_mutex> lock(textureRegistry.mutex);
+    textureRegistry.textures[texels.data()] = &header;
+    textureRegistry.version++;
+  }
+
+  ~UploadedTexture(){
+    std::unique_lock<std::shared_mutex> lock(textureRegistry.mutex);
+    textureRegistry.textures.erase(texels.data());
+    textureRegistry.version++;
+  }
+
+  UploadedTexture(UploadedTexture const&) = delete;
+  UploadedTexture& operator=(UploadedTexture const&) = delete;
+};
+
+/// Dekomprimovany blok v cache vlakna
+struct DecodedBlock{
+  void const* block  = nullptr;  // adresa komprimovaneho bloku
+  uint64_t    upload = 0;
+  TexelRGBA8  texels[16];
+};
+
+/// Obdelnik v pixelech [x0,x1) x [y0,y1)
+struct Rect{
+  int x0, y0;
+  int x1, y1;
+};
+
+/// Hranova funkce E(x,y) = a*x + b*y + c v pevne radove carce (subpixelBits bitu pod pixelem)
+struct EdgeFunction{
+  int64_t a;
+  int64_t b;
+  int64_t c;
+  int64_t bias; // o kolik je c snizeno top-left pravidlem, pro barycentricke souradnice se vraci zpet
+};
+
+/// Pripraveny trojuhelnik pro rasterizaci, edge[i] lezi naproti vrcholu i (--> lambda_i)
+struct TriangleSetup{
+  EdgeFunction edge[3];
+  float        invArea2;  // 1 / dvojnasobek obsahu v subpixelech^2
+  float        invW[3];   // 1 / w vrcholu pro perspektivne korektni interpolaci
+  float        zmin;      // nejblizsi hloubka trojuhelniku (s rezervou na zaokrouhleni interpolace)
+  bool         clockwise;
+  Rect         bounds;    // boundary box v pixelech orezany na framebuffer
+};
+
+/// Hierarchicka hloubka: maximum hloubky v blocich 8x8 pixelu (souradnice rasterizace, pred otocenim y)
+struct HierarchicalZ{
+  void const*          depth = nullptr; // buffer hloubky, pro ktery jsou maxima platna (nullptr = neplatne)
+  uint32_t             blocksX = 0;
+  uint32_t             blocksY = 0;
+  std::vector<float>   maxDepth;
+  std::vector<uint8_t> dirty;           // do bloku se zapisovalo, maximum je jen horni odhad
+};
+
+using AttributeFetch = void(*)(Attribute& attribute, uint8_t const* base, uint64_t stride, uint32_t id);
+using IndexDecode    = void(*)(void const* indices, uint32_t first, uint32_t count, uint32_t* out);
+
+/// Predpripraveny VertexArray: jen aktivni atributy s vyresenymi adresami a funkcemi pro dany typ
+struct VertexFetchPlan{
+  struct Entry{
+    uint32_t       attrib;
+    uint8_t const* base;    // buffer + offset
+    uint64_t       stride;
+    AttributeFetch fetch;
+    uint32_t       components;
+  };
+
+  int32_t     vertexArray = -1;  // ze ktereho VertexArray byl plan sestaven, -1 = neplatny
+  Entry       entries[maxAttributes];
+  uint32_t    nofEntries = 0;
+  void const* indices = nullptr;
+  IndexDecode decode = nullptr;
+};
+
+struct VaryingPlan;
+using VaryingInterpolation = void(*)(Primitive const& primitive, float const* weights, InFragment& inFragment, VaryingPlan const& plan);
+
+/// Predpripraveny Program: kernel interpolace jen pro aktivni varyingy (vs2fs)
+struct VaryingPlan{
+  int32_t              program = -1;  // ze ktereho Programu byl plan sestaven, -1 = neplatny
+  uint32_t             slots[maxAttributes];
+  AttributeType        types[maxAttributes];
+  uint32_t             components[maxAttributes];
+  uint32_t             nofSlots = 0;
+  VaryingInterpolation interpolate = nullptr;
+};
+
+/// Vystup vertex stage jednoho DRAW: kazdy pouzity vrchol (gl_VertexID) je spocitan prave jednou
+struct TransformedVertices{
+  std::vector<uint32_t>  ids;       // gl_VertexID spocitanych vrcholu
+  std::vector<OutVertex> vertices;  // vystupy vertex shaderu ve stejnem poradi jako ids
+  std::vector<uint32_t>  elements;  // pro kazdou invokaci index do vertices
+  std::vector<uint32_t>  slot;      // post-transform cache: gl_VertexID -> index do vertices
+  std::vector<uint32_t>  stamp;     // cislo DRAW, ve kterem je slot platny
+  uint32_t               current = 0;
+};
+
+/// Stav vykreslovaciho prikazu, ktery si trojuhelniky nesou az do rasterizace
+struct DrawState{
+  Program         prg;
+  VaryingPlan     varyings;
+  ProgramSettings settings;
+  ShaderInterface si;          // sestaveno jednou pro DRAW
+  HierarchicalZ*  hiZ;
+  uint32_t        gl_DrawID;
+  uint32_t        instance;    // gl_InstanceID (izg_instanceID)
+  bool            backfaceCulling;
+  bool            depthOnly;   // jen hloubka: bez varyingu a fragment shaderu
+  Image const*    targets[maxRenderTargets]; // render targety framebufferu, nullptr = nezapisuje se
+  alignas(16) uint8_t constants[maxDrawConstants]; // blok konstant od ProgramSettings::prepare
+};
+
+/// Odlozene cisteni framebufferu (GPUSettings::fastClear), dlazdice maji stejnou mrizku jako binner
+struct LazyClear{
+  uint32_t             tileSize = 0;
+  uint32_t             tilesX = 0, tilesY = 0;
+  uint8_t              color[maxPixelBytes];  // vzor pixelu barvy
+  uint8_t              depth[sizeof(float)];  // vzor pixelu hloubky
+  std::vector<uint8_t> tiles;                 // bity cisteni, ktera na dlazdici cekaji
+  bool                 pending = false;
+};
+
+/// Fragmenty pro zapis do framebufferu (ROP), barva uz je prevedena na RGBA8 (R v nejnizsim bajtu)
+struct RopSpan{
+  uint32_t count = 0;
+  uint32_t color[shaderBatchSize];
+  float    z[shaderBatchSize];
+  int      x[shaderBatchSize];
+  int      y[shaderBatchSize];
+  uint8_t  lane[shaderBatchSize]; // draha davky, jejiz hodnoty izg_fragmentOutput patri fragmentu
+};
+
+/// Vystupy fragment shaderu do render targetu (izg_fragmentOutput), po drahach davky
+struct FragmentOutputs{
+  uint32_t  written;          // bity targetu, do kterych shader zapsal
+  glm::vec4 values[maxRenderTargets][shaderBatchSize];
+};
+
+/// Fragmenty jednoho trojuhelniku cekajici na davkovy fragment shader
+struct FragmentQueue{
+  uint32_t    count = 0;
+  Barycentric barycentrics[shaderBatchSize];
+  float       z[shaderBatchSize];
+  int         x[shaderBatchSize];
+  int         y[shaderBatchSize];
+};
+
+/// Trojuhelniky setridene do dlazdic obrazovky, zpracovavaji se az pri flush
+struct Binner{
+  Framebuffer*                       fb = nullptr;
+  uint32_t                           tileSize = 0;
+  uint32_t                           tilesX = 0, tilesY = 0;
+  std::vector<DrawState>             draws;
+  std::vector<Primitive>             primitives;
+  std::vector<TriangleSetup>         setups;
+  std::vector<uint32_t>              primitiveDraw;
+  std::vector<std::vector<uint32_t>> bins;
+};
+
+/// Pracovni vlakna - hlavni vlakno se na praci podili take
+class WorkerPool{
+  public:
+    ~WorkerPool(){ resize(0); }
+    void resize(uint32_t nofWorkers);
+    uint32_t size() const { return (uint32_t) workers.size(); }
+    void run(uint32_t nofJobs, std::function<void(uint32_t)> const& job);
+  private:
+    void loop(uint64_t seen);
+    void work();
+
+    std::vector<std::thread>                   workers;
+    std::mutex                                 mutex;
+    std::condition_variable                    start, done;
+    std::function<void(uint32_t)> const*       job = nullptr;
+    std::atomic<uint32_t>                      next{0};
+    uint32_t                                   nofJobs = 0;
+    uint32_t                                   running = 0;
+    uint64_t                                   generation = 0;
+    bool                                       quit = false;
+};
+
+uint32_t const nofPrograms = sizeof(GPUMemory::programs) / sizeof(Program);
+uint32_t const nofFramebuffers = sizeof(GPUMemory::framebuffers) / sizeof(Framebuffer);
+uint32_t const nofTextures = sizeof(GPUMemory::textures) / sizeof(Texture);
+
+/// Nastaveni programu, podle kterych se provadi command buffer (izg_submit je kopiruje)
+struct ExecutionSettings{
+  ProgramSettings programs[nofPrograms];
+};
+
+GPUSettings     gpuSettings;
+ExecutionSettings executionSettings;
+ExecutionSettings const* executed = &executionSettings; // nastaveni prave provadeneho command bufferu
+HierarchicalZ   hiZ[nofFramebuffers];
+LazyClear       lazyClear[nofFramebuffers];
+std::map<GPUMemory const*, std::vector<std::unique_ptr<UploadedTexture>>> textureStorage; // pamet nahranych textur kazde GPUMemory podle id
+std::vector<glm::vec4> renderTargetStorage[nofTextures];
+std::vector<std::vector<glm::vec4>> retiredTargets; // pamet render targetu pred zmenou velikosti, uvolni se v izg_finish
+uint64_t        textureUploads = 0;
+TransformedVertices transformed;
+VertexFetchPlan     fetchPlan;
+VaryingPlan         varyingPlan;
+GPUStatistics   gpuStatistics;
+GPUStatistics   executionStatistics; // pocitadla provadeneho command bufferu, zapisuje jen provadejici vlakno
+Binner          binner;
+WorkerPool      workerPool;
+
+GPUSettings& izg_settings(){
+  return gpuSettings;
+}
+
+ProgramSettings& izg_programSettings(uint32_t programId){
+  return executionSettings.programs[programId];
+}
+
+// Blok konstant (a funkce, ktera ho vyplnila) a instance DRAW, jehoz shadery vlakno prave spousti
+thread_local void const* drawConstants = nullptr;
+thread_local DrawPrepare drawPrepare   = nullptr;
+thread_local uint32_t    drawInstance  = 0;
+
+void const* izg_drawConstants(){
+  return drawConstants;
+}
+
+void const* izg_drawConstants(DrawPrepare prepare){
+  return drawPrepare == prepare ? drawConstants : nullptr;
+}
+
+uint32_t izg_instanceID(){
+  return drawInstance;
+}
+
+// Trojuhelnik, jehoz fragmenty vlakno prave stinuje (pro izg_derivatives)
+thread_local Primitive const*     shadedPrimitive = nullptr;
+thread_local TriangleSetup const* shadedSetup     = nullptr;
+
+/// Shadery nasledujicich volani na tomto vlakne patri DRAW state
+void useDrawState(DrawState const& state){
+  drawConstants = state.settings.prepare ? state.constants : nullptr;
+  drawPrepare   = state.settings.prepare;
+  drawInstance  = state.instance;
+}
+
+/// Stav DRAW plati na vlakne jen po dobu ulohy, shadery volane mimo DRAW pak ctou si.uniforms
+struct DrawStateScope{
+  explicit DrawStateScope(DrawState const& state){ useDrawState(state); }
+  ~DrawStateScope(){
+    drawConstants   = nullptr;
+    drawPrepare     = nullptr;
+    drawInstance    = 0;
+    shadedPrimitive = nullptr;
+    shadedSetup     = nullptr;
+  }
+};
+
+// Vystupy do render targetu fragmentu, ktere vlakno prave stinuje
+thread_local FragmentOutputs fragmentOutputs;
+
+void izg_fragmentOutput(uint32_t target, glm::vec4 const& value){
+  izg_fragmentOutput(target, 0, value);
+}
+
+void izg_fragmentOutput(uint32_t target, uint32_t lane, glm::vec4 const& value){
+  if(target >= maxRenderTargets || lane >= shaderBatchSize)
+    return;
+  fragmentOutputs.values[target][lane] = value;
+  fragmentOutputs.written |= 1u << target;
+}
+
+#if IZG_AVX2
+bool hasAVX2(){
+#if defined(_MSC_VER)
+  static bool const avx2 = []{
+    int info[4];
+    __cpuid(info, 1);
+    // OS musi ukladat registry ymm (OSXSAVE + XCR0)
+    if(!(info[2] & (1 << 27)) || (_xgetbv(0) & 6) != 6)
+      return false;
+    __cpuidex(info, 7, 0);
+    return (info[1] & (1 << 5)) != 0;
+  }();
+#else
+  static bool const avx2 = __builtin_cpu_supports("avx2");
+#endif
+  return avx2;
+}
+#endif
 
-    if(type == IndexType::UINT32){
-      uint32_t* index = (uint32_t*)((uint8_t*) mem.buffers[bufferID].data + offset);
-      inVertex.gl_VertexID = (uint32_t) index[i];
+void WorkerPool::resize(uint32_t nofWorkers){
+  if(nofWorkers == workers.size())
+    return;
+
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    quit = true;
+  }
+  start.notify_all();
+  for(auto& w : workers)
+    w.join();
+  workers.clear();
+
+  quit = false;
+  for(uint32_t i = 0; i < nofWorkers; ++i)
+    workers.emplace_back(&WorkerPool::loop, this, generation);
+}
+
+void WorkerPool::work(){
+  for(uint32_t i = next++; i < nofJobs; i = next++)
+    (*job)(i);
+}
+
+void WorkerPool::loop(uint64_t seen){
+  for(;;){
+    {
+      std::unique_lock<std::mutex> lock(mutex);
+      start.wait(lock, [&]{ return quit || generation != seen; });
+      if(quit)
+        return;
+      seen = generation;
     }
+
+    work();
+
+    std::lock_guard<std::mutex> lock(mutex);
+    if(--running == 0)
+      done.notify_one();
+  }
+}
+
+void WorkerPool::run(uint32_t n, std::function<void(uint32_t)> const& f){
+  // Bez vlaken nebo s jedinou ulohou neni co paralelizovat
+  if(workers.empty() || n <= 1){
+    for(uint32_t i = 0; i < n; ++i)
+      f(i);
+    return;
+  }
+
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    job     = &f;
+    nofJobs = n;
+    next    = 0;
+    running = (uint32_t) workers.size();
+    ++generation;
   }
+  start.notify_all();
+
+  work();
+
+  std::unique_lock<std::mutex> lock(mutex);
+  done.wait(lock, [&]{ return running == 0; });
+  job = nullptr;
+}
+
+/// Nacteni atributu typu T vrcholu id, Packed = atributy jsou v bufferu tesne za sebou (stride == sizeof(T))
+template<typename T, bool Packed>
+void fetchAttribute(Attribute& attribute, uint8_t const* base, uint64_t stride, uint32_t id){
+  *(T*) &attribute = *(T const*) (base + (Packed ? sizeof(T) : stride) * id);
+}
+
+/// Dekodovani indexu [first, first+count) typu T
+template<typename T>
+void decodeIndices(void const* indices, uint32_t first, uint32_t count, uint32_t* out){
+  T const* index = (T const*) indices + first;
+  for (uint32_t i = 0; i < count; ++i)
+    out[i] = index[i];
 }
 
-void vertex_attributes(GPUMemory& mem,InVertex& inVertex){
-      for (uint32_t a = 0; a < maxAttributes; ++a){
-      
-      VertexAttrib va = mem.vertexArrays[mem.activatedVertexArray].vertexAttrib[a];
+/// Bez index bufferu je gl_VertexID cislo invokace
+void decodeSequence(void const*, uint32_t first, uint32_t count, uint32_t* out){
+  for (uint32_t i = 0; i < count; ++i)
+    out[i] = first + i;
+}
 
-      if(va.type != AttributeType::EMPTY){
-        Attribute *attribute = (Attribute*) ((uint8_t*) mem.buffers[va.bufferID].data + va.offset + va.stride*inVertex.gl_VertexID);
+template<typename T>
+AttributeFetch attributeFetch(uint64_t stride){
+  return stride == sizeof(T) ? fetchAttribute<T, true> : fetchAttribute<T, false>;
+}
 
-        if(va.type == AttributeType::FLOAT)
-          inVertex.attributes[a].v1 = *((float*)attribute);
+/**
+ * @brief This function compiles vertex array into fetch plan (called by BIND_VERTEXARRAY)
+ *
+ * @param mem GPU memory
+ * @param id index of vertex array
+ */
+void compileVertexArray(GPUMemory& mem, uint32_t id){
+  VertexArray const& vao = mem.vertexArrays[id];
 
-        if(va.type == AttributeType::VEC2)
-          inVertex.attributes[a].v2 = *((glm::vec2*)attribute);
+  fetchPlan.vertexArray = (int32_t) id;
+  fetchPlan.nofEntries = 0;
 
-        if(va.type == AttributeType::VEC3)
-          inVertex.attributes[a].v3 = *((glm::vec3*)attribute);
+  for (uint32_t a = 0; a < maxAttributes; ++a){
+    VertexAttrib const& va = vao.vertexAttrib[a];
+    AttributeFetch fetch = nullptr;
+    uint32_t components = 0;
+
+    if(va.type == AttributeType::FLOAT){ fetch = attributeFetch<float    >(va.stride); components = 1; }
+    if(va.type == AttributeType::VEC2 ){ fetch = attributeFetch<glm::vec2>(va.stride); components = 2; }
+    if(va.type == AttributeType::VEC3 ){ fetch = attributeFetch<glm::vec3>(va.stride); components = 3; }
+    if(va.type == AttributeType::VEC4 ){ fetch = attributeFetch<glm::vec4>(va.stride); components = 4; }
+
+    if(fetch == nullptr)
+      continue;
+
+    VertexFetchPlan::Entry& e = fetchPlan.entries[fetchPlan.nofEntries++];
+    e.attrib = a;
+    e.base   = (uint8_t const*) mem.buffers[va.bufferID].data + va.offset;
+    e.stride = va.stride;
+    e.fetch  = fetch;
+    e.components = components;
+  }
 
-        if(va.type == AttributeType::VEC4)
-          inVertex.attributes[a].v4 = *((glm::vec4*)attribute);
-      }
+  // Indexing
+  if(vao.indexBufferID == -1){
+    fetchPlan.indices = nullptr;
+    fetchPlan.decode  = decodeSequence;
+  } else {
+    fetchPlan.indices = (uint8_t const*) mem.buffers[vao.indexBufferID].data + vao.indexOffset;
+    if(vao.indexType == IndexType::UINT8 ) fetchPlan.decode = decodeIndices<uint8_t >;
+    if(vao.indexType == IndexType::UINT16) fetchPlan.decode = decodeIndices<uint16_t>;
+    if(vao.indexType == IndexType::UINT32) fetchPlan.decode = decodeIndices<uint32_t>;
+  }
+}
+
+void bindVertexArray(GPUMemory& mem, uint32_t id){
+  mem.activatedVertexArray = id;
+  compileVertexArray(mem, id);
+}
+
+void indexing(VertexFetchPlan const& plan, uint32_t first, uint32_t count, uint32_t* ids){
+  plan.decode(plan.indices, first, count, ids);
+}
+
+void vertex_attributes(VertexFetchPlan const& plan, InVertex& inVertex){
+  for (uint32_t e = 0; e < plan.nofEntries; ++e)
+    plan.entries[e].fetch(inVertex.attributes[plan.entries[e].attrib], plan.entries[e].base, plan.entries[e].stride, inVertex.gl_VertexID);
+}
+
+/// Nacteni atributu davky vrcholu rovnou do SoA
+void vertex_attributes(VertexFetchPlan const& plan, InVertexBatch& batch){
+  for (uint32_t e = 0; e < plan.nofEntries; ++e){
+    VertexFetchPlan::Entry const& entry = plan.entries[e];
+    AttributeBatch& out = batch.attributes[entry.attrib];
+
+    for (uint32_t i = 0; i < shaderBatchSize; ++i){
+      Attribute attribute;
+      entry.fetch(attribute, entry.base, entry.stride, batch.gl_VertexID[i]);
+      for (uint32_t c = 0; c < entry.components; ++c)
+        out.v[c][i] = ((float const*) &attribute)[c];
     }
+  }
 }
 
 void prespective_division(Primitive& primitive) {
@@ -90,309 +614,2611 @@ void viewport_transformation(Framebuffer& fb, Primitive& primitive) {
   }
 }
 
-void fragment_attributes(Primitive& primitive, Barycentric& barycentrics, InFragment& inFragment, Program& prg){
-  float h0 = primitive.vertex[0].gl_Position.w,
-        h1 = primitive.vertex[1].gl_Position.w,
-        h2 = primitive.vertex[2].gl_Position.w,
-        s;
-
-  s = (barycentrics.lambda0/h0) + (barycentrics.lambda1/h1) + (barycentrics.lambda2/h2);
-
-  float pLambda0 = barycentrics.lambda0 / (h0 * s),
-        pLambda1 = barycentrics.lambda1 / (h1 * s),
-        pLambda2 = barycentrics.lambda2 / (h2 * s);
-
-  for (uint32_t a = 0; a < maxAttributes; ++a){
-      
-  Attribute a0 = primitive.vertex[0].attributes[a],
-            a1 = primitive.vertex[1].attributes[a],
-            a2 = primitive.vertex[2].attributes[a];
-
-  AttributeType type = prg.vs2fs[a];
+/// Interpolace jednoho varyingu typu Type vahami w
+template<AttributeType Type>
+inline void interpolateSlot(Attribute& out, Attribute const& a0, Attribute const& a1, Attribute const& a2, float const* w){
+  if(Type == AttributeType::FLOAT) out.v1 = a0.v1*w[0] + a1.v1*w[1] + a2.v1*w[2];
+  if(Type == AttributeType::VEC2 ) out.v2 = a0.v2*w[0] + a1.v2*w[1] + a2.v2*w[2];
+  if(Type == AttributeType::VEC3 ) out.v3 = a0.v3*w[0] + a1.v3*w[1] + a2.v3*w[2];
+  if(Type == AttributeType::VEC4 ) out.v4 = a0.v4*w[0] + a1.v4*w[1] + a2.v4*w[2];
+}
 
-  if(type != AttributeType::EMPTY){
+constexpr AttributeType varyingKernelType[varyingKernelTypes] = {AttributeType::EMPTY, AttributeType::FLOAT, AttributeType::VEC2, AttributeType::VEC3, AttributeType::VEC4};
 
-    if(type == AttributeType::FLOAT)
-          inFragment.attributes[a].v1 = a0.v1*pLambda0 + a1.v1*pLambda1 + a2.v1*pLambda2;
+/// Typ slotu v rozlozeni Layout (cislo v soustave o zakladu varyingKernelTypes, slot 0 = nejnizsi cifra)
+constexpr AttributeType layoutType(uint32_t layout, size_t slot){
+  return slot == 0 ? varyingKernelType[layout % varyingKernelTypes] : layoutType(layout / varyingKernelTypes, slot - 1);
+}
 
-    if(type == AttributeType::VEC2)
-          inFragment.attributes[a].v2 = a0.v2*pLambda0 + a1.v2*pLambda1 + a2.v2*pLambda2;
+template<uint32_t Layout, size_t... Slots>
+inline void interpolateLayoutSlots(Primitive const& primitive, float const* w, InFragment& inFragment, std::index_sequence<Slots...>){
+  (interpolateSlot<layoutType(Layout, Slots)>(inFragment.attributes[Slots], primitive.vertex[0].attributes[Slots], primitive.vertex[1].attributes[Slots], primitive.vertex[2].attributes[Slots], w), ...);
+}
 
-    if(type == AttributeType::VEC3)
-          inFragment.attributes[a].v3 = a0.v3*pLambda0 + a1.v3*pLambda1 + a2.v3*pLambda2;
+/// Kernel pro pevne rozlozeni varyingu, prazdne sloty se vubec nectou
+template<uint32_t Layout>
+void interpolateLayout(Primitive const& primitive, float const* weights, InFragment& inFragment, VaryingPlan const&){
+  interpolateLayoutSlots<Layout>(primitive, weights, inFragment, std::make_index_sequence<varyingKernelSlots>());
+}
 
-    if(type == AttributeType::VEC4)
-          inFragment.attributes[a].v4 = a0.v4*pLambda0 + a1.v4*pLambda1 + a2.v4*pLambda2;
+/// Obecny kernel pro rozlozeni, ktera nemaji vlastni instanci (varyingy ve slotech >= 4)
+void interpolateGeneric(Primitive const& primitive, float const* weights, InFragment& inFragment, VaryingPlan const& plan){
+  for (uint32_t i = 0; i < plan.nofSlots; ++i){
+    uint32_t a = plan.slots[i];
+    Attribute& out = inFragment.attributes[a];
+    Attribute const& a0 = primitive.vertex[0].attributes[a];
+    Attribute const& a1 = primitive.vertex[1].attributes[a];
+    Attribute const& a2 = primitive.vertex[2].attributes[a];
+
+    switch(plan.types[i]){
+      case AttributeType::FLOAT: interpolateSlot<AttributeType::FLOAT>(out, a0, a1, a2, weights); break;
+      case AttributeType::VEC2 : interpolateSlot<AttributeType::VEC2 >(out, a0, a1, a2, weights); break;
+      case AttributeType::VEC3 : interpolateSlot<AttributeType::VEC3 >(out, a0, a1, a2, weights); break;
+      case AttributeType::VEC4 : interpolateSlot<AttributeType::VEC4 >(out, a0, a1, a2, weights); break;
+      default: break;
     }
   }
 }
 
-void perFragmentOperations(Framebuffer& fb, OutFragment outFragment, float inFragmentZcoord, uint32_t x, uint32_t y){
-  if(outFragment.discard == false){
-    float* depth = nullptr;
-    uint8_t* pixel = nullptr;
+template<size_t... Layouts>
+constexpr std::array<VaryingInterpolation, sizeof...(Layouts)> makeVaryingKernels(std::index_sequence<Layouts...>){
+  return {{ interpolateLayout<(uint32_t) Layouts>... }};
+}
 
-    if(fb.depth.data == nullptr || fb.color.data == nullptr)
-      return;
+std::array<VaryingInterpolation, varyingKernelLayouts> const varyingKernels = makeVaryingKernels(std::make_index_sequence<varyingKernelLayouts>());
 
-    if(fb.yReversed == false){
-      // Efektivni adresa hloubky a barvy ve framebufferu
-      depth = (float*) getPixel(fb.depth, x, y);
-      pixel = (uint8_t*) getPixel(fb.color, x, y);
-    } else {
-      depth = (float*) getPixel(fb.depth, x, fb.height - y - 1);
-      pixel = (uint8_t*) getPixel(fb.color, x, fb.height - y - 1);
-    }
+/**
+ * @brief This function compiles varyings of program into interpolation plan (called by BIND_PROGRAM)
+ *
+ * @param mem GPU memory
+ * @param id index of program
+ */
+void compileProgram(GPUMemory& mem, uint32_t id){
+  Program const& prg = mem.programs[id];
+
+  varyingPlan.program = (int32_t) id;
+  varyingPlan.nofSlots = 0;
+
+  // Cislo rozlozeni slotu 0..3 v soustave o zakladu varyingKernelTypes
+  uint32_t layout = 0, digit = 1;
+  bool generic = false;
+
+  for (uint32_t a = 0; a < maxAttributes; ++a, digit *= a < varyingKernelSlots ? varyingKernelTypes : 1){
+    uint32_t t = 1;
+    while(t < varyingKernelTypes && varyingKernelType[t] != prg.vs2fs[a])
+      ++t;
+
+    // EMPTY a celociselne typy se neinterpoluji
+    if(t == varyingKernelTypes)
+      continue;
+
+    varyingPlan.slots[varyingPlan.nofSlots] = a;
+    varyingPlan.types[varyingPlan.nofSlots] = prg.vs2fs[a];
+    varyingPlan.components[varyingPlan.nofSlots] = t;
+    ++varyingPlan.nofSlots;
+
+    if(a < varyingKernelSlots)
+      layout += t * digit;
+    else
+      generic = true;
+  }
 
-    //a - kanal nepruhlednosti
-    float a = outFragment.gl_FragColor[3];
+  varyingPlan.interpolate = generic ? interpolateGeneric : varyingKernels[layout];
+}
 
-    if(inFragmentZcoord < *depth) {
-      *depth = inFragmentZcoord;
+void bindProgram(GPUMemory& mem, uint32_t id){
+  mem.activatedProgram = id;
+  compileProgram(mem, id);
+}
 
-      if(a == 1.0f){
-        for (uint32_t i = 0; i < fb.color.channels; ++i)
-          pixel[fb.color.channelTypes[i]] = (uint8_t) (outFragment.gl_FragColor[i] * 255);
-      } else {
-        glm::vec4 framebuffer_color(pixel[0] / 255.f, pixel[1] / 255.f,  pixel[2] / 255.f, a);
-        glm::vec4 fragcolor = outFragment.gl_FragColor;
+void fragment_attributes(Primitive const& primitive, TriangleSetup const& setup, Barycentric const& barycentrics, InFragment& inFragment, VaryingPlan const& plan){
+  if(plan.nofSlots == 0)
+    return;
+
+  // Perspektivne korektni vahy: lambda_i/w_i normalizovane souctem
+  float weights[3] = {
+    barycentrics.lambda0 * setup.invW[0],
+    barycentrics.lambda1 * setup.invW[1],
+    barycentrics.lambda2 * setup.invW[2],
+  };
+  float s = 1.f / (weights[0] + weights[1] + weights[2]);
+  weights[0] *= s;
+  weights[1] *= s;
+  weights[2] *= s;
+
+  plan.interpolate(primitive, weights, inFragment, plan);
+}
 
-        glm::vec3 final_color = fragcolor*a + framebuffer_color*(1.0f-a);
+/// Kanal barvy fragmentu -> 8 bitu (orezani do <0,1>, NaN = 0)
+inline uint32_t ropChannel(float c){
+  return (uint32_t) ((c > 0.f ? (c < 1.f ? c : 1.f) : 0.f) * 255.f);
+}
 
-        for (uint32_t i = 0; i < fb.color.channels - 1; ++i)
-        pixel[fb.color.channelTypes[i]] = (uint8_t) (std::round((final_color[i] * 255)*100.f)/100.f);
-      }
-    }
-  }
+inline uint32_t ropColor(float r, float g, float b, float a){
+  return ropChannel(r) | ropChannel(g) << 8 | ropChannel(b) << 16 | ropChannel(a) << 24;
 }
 
-void rasterize(GPUMemory& mem, Framebuffer& fb, Primitive& primitive, bool backfaceCulling, Program prg) {
-  // Barycentricke souradnice + obsah trojuhelniku
-  Barycentric barycentrics;
+/// x / 255 zaokrouhlene, pro x <= 255 * 255
+inline uint32_t div255(uint32_t x){
+  x += 128;
+  return (x + (x >> 8)) >> 8;
+}
 
-  // Hranice trojuhelniku: V0-V1, V1-V2, V2-V0
-  glm::vec3 primitive_edge[3];
+/// Blend R, G, B ve fixed-point (s*a + d*(255-a)) / 255, R a B v jednom nasobeni (16 bitove drahy), alfa cile zustava
+inline uint32_t blendRGBA8(uint32_t s, uint32_t d, uint32_t a){
+  uint32_t ia = 255 - a;
+  uint32_t rb = (s & 0xff00ff) * a + (d & 0xff00ff) * ia + 0x800080;
+  rb = ((rb + ((rb >> 8) & 0xff00ff)) >> 8) & 0xff00ff;
+  uint32_t g = div255(((s >> 8) & 255) * a + ((d >> 8) & 255) * ia);
+  return rb | g << 8 | (d & 0xff000000);
+}
 
-  /// Vypocet hran trojuhelniku
-  for (uint32_t i = 0; i < 3; ++i)
-      primitive_edge[i] = primitive.vertex[(i+1)%3].gl_Position - primitive.vertex[i].gl_Position;
+/// Do hloubky pixelu [x,y] (souradnice rasterizace) se zapsalo, maximum bloku mohlo klesnout a prepocita se az pri dalsim dotazu
+inline void hiZWritten(HierarchicalZ* hiZ, uint32_t x, uint32_t y){
+  if(hiZ)
+    hiZ->dirty[(y / hiZBlock) * hiZ->blocksX + x / hiZBlock] = 1;
+}
 
-  /// Obsah trojuhelniku (vznikne nasobkem 2 hran, je ve slozce: z) --> 0.5 * (vektor1 x vektor2) 
-  barycentrics.area = (glm::cross(primitive_edge[0],primitive_edge[1]) * 0.5f).z;;
+/**
+ * @brief This function writes span of fragments to the framebuffer (depth test, blending, color and render target write)
+ *
+ * Colors are blended in 8-bit fixed point. RGBA8 framebuffers with channels in memory order
+ * are written as whole 32-bit pixels, other formats channel by channel.
+ */
+void ropSpan(Framebuffer& fb, DrawState const& state, RopSpan const& span){
+  if(fb.depth.data == nullptr)
+    return;
+
+  // Render targety, do kterych fragment shader zapsal
+  uint32_t targets = fragmentOutputs.written;
+  for (uint32_t t = 0; t < maxRenderTargets; ++t)
+    if(state.targets[t] == nullptr)
+      targets &= ~(1u << t);
+
+  Image const& color = fb.color;
+  bool packed = color.bytesPerPixel == sizeof(uint32_t) && color.channels == 4 &&
+                color.channelTypes[0] == 0 && color.channelTypes[1] == 1 && color.channelTypes[2] == 2 && color.channelTypes[3] == 3;
+
+  for (uint32_t i = 0; i < span.count; ++i){
+    uint32_t x = span.x[i], y = fb.yReversed ? fb.height - span.y[i] - 1 : span.y[i];
+
+    float* depth = (float*) getPixel(fb.depth, x, y);
+    if(!(span.z[i] < *depth))
+      continue;
+
+    if(state.settings.depthWrite){
+      *depth = span.z[i];
+      hiZWritten(state.hiZ, x, span.y[i]);
+    }
 
-  /// Kontrola zda jsou hrany trojuhelniku clockwise
-  bool cw = (glm::cross(primitive_edge[0], primitive_edge[1]).z < 0 || glm::cross(primitive_edge[1], primitive_edge[2]).z < 0 || glm::cross(primitive_edge[2], primitive_edge[0]).z < 0);
+    // Render targety maji souradnice rasterizace
+    for (uint32_t t = 0; targets >> t; ++t)
+      if(targets >> t & 1)
+        std::memcpy(getPixel(*state.targets[t], span.x[i], span.y[i]), &fragmentOutputs.values[t][span.lane[i]], sizeof(glm::vec4));
 
-  // backface culling a trojuhelnik je clock wise, vykresleni se neprovede
-  if(backfaceCulling && cw)
-        return;
+    // Framebuffer bez barvy (stinova mapa) - jen hloubka
+    if(color.data == nullptr || !state.settings.colorWrite)
+      continue;
 
-  // boundary box vykreslovaneho primitiva - optimalizace
-  int x_MIN = MAX(0, MIN(primitive.vertex[0].gl_Position.x, MIN(primitive.vertex[1].gl_Position.x,primitive.vertex[2].gl_Position.x))),
-      y_MIN = MAX(0, MIN(primitive.vertex[0].gl_Position.y, MIN(primitive.vertex[1].gl_Position.y,primitive.vertex[2].gl_Position.y))),
-      x_MAX = MIN(fb.width, MAX(primitive.vertex[0].gl_Position.x, MAX(primitive.vertex[1].gl_Position.x,primitive.vertex[2].gl_Position.x))),
-      y_MAX = MIN(fb.height, MAX(primitive.vertex[0].gl_Position.y, MAX(primitive.vertex[1].gl_Position.y,primitive.vertex[2].gl_Position.y)));
+    uint8_t* pixel = (uint8_t*) getPixel(color, x, y);
+    uint32_t src = span.color[i], a = src >> 24;
 
-  // Zmena souradnic [x,y] width * height
-  for (int y = y_MIN; y < y_MAX; ++y)
-  {
-    for (int x = x_MIN; x < x_MAX; ++x)
-    {
-      // Stred aktualniho pixelu
-      glm::vec3 pixelCoord((float) x + 0.5f, (float) y + 0.5f, 0.f);
-
-      // Vypocet barycentrickych souradnic bodu [x,y]
-      barycentrics.lambda0 = ((glm::cross(primitive_edge[1], pixelCoord - glm::vec3(primitive.vertex[1].gl_Position)).z)*0.5f) / barycentrics.area;
-      barycentrics.lambda1 = ((glm::cross(primitive_edge[2], pixelCoord - glm::vec3(primitive.vertex[2].gl_Position)).z)*0.5f) / barycentrics.area;
-      barycentrics.lambda2 = ((glm::cross(primitive_edge[0], pixelCoord - glm::vec3(primitive.vertex[0].gl_Position)).z)*0.5f) / barycentrics.area;
-
-      float lambda_sum = (barycentrics.lambda0 + barycentrics.lambda1 + barycentrics.lambda2);
-
-      if(((lambda_sum <= 1.0f + 1e-2) && barycentrics.lambda0 >= 0.0f && barycentrics.lambda1 >= 0.0f && barycentrics.lambda2 >= 0.0f)){
-        InFragment inFragment;
-        
-        // Hloubka fragmentu
-        inFragment.gl_FragCoord.x = pixelCoord.x;
-        inFragment.gl_FragCoord.y = pixelCoord.y;
-        inFragment.gl_FragCoord.z = barycentrics.lambda0 * primitive.vertex[0].gl_Position.z + barycentrics.lambda1 * primitive.vertex[1].gl_Position.z + barycentrics.lambda2 * primitive.vertex[2].gl_Position.z;
-
-        // Interpolace atributu fragmentu
-        fragment_attributes(primitive, barycentrics, inFragment, prg);
-
-        OutFragment outFragment;
-        
-        ShaderInterface si;
-        si.uniforms = mem.uniforms;
-        si.textures = mem.textures;
-        si.gl_DrawID = mem.gl_DrawID;
-
-        /// Fragment shader
-        prg.fragmentShader(outFragment, inFragment, si);
-        
-        /// PerFragmentOperace
-        // Orezani barvy do intervalu <0,1> 
-        glm::clamp(outFragment.gl_FragColor, 0.f, 1.f);
-        perFragmentOperations(fb, outFragment, inFragment.gl_FragCoord.z, x, y);
+    if(packed){
+      if(a != 255){
+        uint32_t dst;
+        std::memcpy(&dst, pixel, sizeof(dst));
+        src = blendRGBA8(src, dst, a);
+      }
+      std::memcpy(pixel, &src, sizeof(src));
+    } else if(a == 255){
+      for (uint32_t c = 0; c < color.channels; ++c)
+        pixel[color.channelTypes[c]] = (uint8_t) (src >> (8 * c));
+    } else {
+      // Alfa cile se pri michani nemeni
+      for (uint32_t c = 0; c + 1 < color.channels; ++c){
+        uint8_t& d = pixel[color.channelTypes[c]];
+        d = (uint8_t) div255(((src >> (8 * c)) & 255) * a + d * (255 - a));
       }
     }
   }
 }
 
-void draw(GPUMemory& mem, DrawCommand cmd){
-  Program prg = mem.programs[mem.activatedProgram];
+int64_t floorDiv(int64_t a, int64_t b){
+  return a >= 0 ? a / b : -((-a + b - 1) / b);
+}
 
-  Primitive primitive;
-  
-  for (uint32_t i = 0; i < cmd.nofVertices; ++i)
-  {
-    InVertex inVertex;
-    OutVertex outVertex;
-    ShaderInterface si;
+/**
+ * @brief This function prepares triangle for rasterization (fixed point edge functions)
+ *
+ * @param fb framebuffer
+ * @param primitive triangle after viewport transformation
+ * @param setup output edge functions and bounds
+ *
+ * @return false if the triangle is degenerate or covers no pixel
+ */
+bool setupTriangle(Framebuffer const& fb, Primitive const& primitive, TriangleSetup& setup){
+  // Prichyceni vrcholu do subpixelove mrizky
+  int64_t vx[3], vy[3];
+  for (uint32_t i = 0; i < 3; ++i){
+    float x = primitive.vertex[i].gl_Position.x * subpixelOne,
+          y = primitive.vertex[i].gl_Position.y * subpixelOne;
+
+    // NaN, nekonecno nebo prilis velka souradnice
+    if(!(x > -subpixelLimit && x < subpixelLimit && y > -subpixelLimit && y < subpixelLimit))
+      return false;
 
-    /// Vertex Assembly - sestaveni vrcholu
-    // Indexing, i = invokace vertex shaderu
-    indexing(mem, i, inVertex);
-    // Nacteni atributu z bufferu
-    vertex_attributes(mem, inVertex);
+    vx[i] = std::llround(x);
+    vy[i] = std::llround(y);
+  }
 
-    /// Shader interface - rozhrani shaderu
-    si.gl_DrawID = mem.gl_DrawID; 
-    si.uniforms = mem.uniforms;
-    si.textures = mem.textures; 
+  // Dvojnasobek orientovaneho obsahu: (V1-V0) x (V2-V0)
+  int64_t area2 = (vx[1] - vx[0]) * (vy[2] - vy[0]) - (vy[1] - vy[0]) * (vx[2] - vx[0]);
+  if(area2 == 0)
+    return false;
 
-    /// Vertex Shader --> outVertex
-    prg.vertexShader(outVertex, inVertex, si);
+  setup.clockwise = area2 < 0;
+  setup.invArea2  = 1.f / (float) (setup.clockwise ? -area2 : area2);
 
-    primitive.vertex[i % 3] = outVertex;
+  for (uint32_t i = 0; i < 3; ++i)
+    setup.invW[i] = 1.f / primitive.vertex[i].gl_Position.w;
 
-    /// Mame-li 3 vrcholy --> provede se perspektivni deleni, viewport transformace, rasterizace, ...
-    if((i+1) % 3 == 0) {
-      prespective_division(primitive);
-      viewport_transformation(mem.framebuffers[mem.activatedFramebuffer], primitive);
-      rasterize(mem, mem.framebuffers[mem.activatedFramebuffer], primitive, cmd.backfaceCulling, prg);
+  for (uint32_t i = 0; i < 3; ++i){
+    // Hrana protilehla vrcholu i: P -> Q
+    uint32_t p = (i + 1) % 3, q = (i + 2) % 3;
+    EdgeFunction& e = setup.edge[i];
+
+    e.a = vy[p] - vy[q];
+    e.b = vx[q] - vx[p];
+
+    // Vnitrek trojuhelniku ma vzdy E >= 0 bez ohledu na orientaci
+    if(setup.clockwise){
+      e.a = -e.a;
+      e.b = -e.b;
     }
+
+    e.c = -(e.a * vx[p] + e.b * vy[p]);
+
+    // Top-left pravidlo: pixel lezici presne na hrane patri jen jednomu ze sousednich trojuhelniku
+    bool topLeft = e.a > 0 || (e.a == 0 && e.b > 0);
+    e.bias = topLeft ? 0 : 1;
+    e.c -= e.bias;
   }
 
-  //Inkrementace DrawID po kazdem prikazu vykreslovani
-  ++mem.gl_DrawID;
+  // Interpolovana hloubka je konvexni kombinace hloubek vrcholu az na zaokrouhleni
+  float z0 = primitive.vertex[0].gl_Position.z, z1 = primitive.vertex[1].gl_Position.z, z2 = primitive.vertex[2].gl_Position.z;
+  float zabs = MAX(1.f, MAX(std::fabs(z0), MAX(std::fabs(z1), std::fabs(z2))));
+  setup.zmin = MIN(z0, MIN(z1, z2)) - 1e-6f * zabs;
+
+  // Boundary box stredu pixelu (x*one + one/2) lezicich v obalce vrcholu
+  int64_t xmin = MIN(vx[0], MIN(vx[1], vx[2])), xmax = MAX(vx[0], MAX(vx[1], vx[2])),
+          ymin = MIN(vy[0], MIN(vy[1], vy[2])), ymax = MAX(vy[0], MAX(vy[1], vy[2]));
+
+  setup.bounds.x0 = (int) MAX((int64_t) 0, -floorDiv(subpixelOne/2 - xmin, subpixelOne));
+  setup.bounds.y0 = (int) MAX((int64_t) 0, -floorDiv(subpixelOne/2 - ymin, subpixelOne));
+  setup.bounds.x1 = (int) MIN((int64_t) fb.width,  floorDiv(xmax - subpixelOne/2, subpixelOne) + 1);
+  setup.bounds.y1 = (int) MIN((int64_t) fb.height, floorDiv(ymax - subpixelOne/2, subpixelOne) + 1);
+
+  return setup.bounds.x0 < setup.bounds.x1 && setup.bounds.y0 < setup.bounds.y1;
 }
 
 /**
- * @brief This function clears the framebuffer (helper function)
- * 
- * @param GPU memory
- * @param Clear Command
+ * @brief This function shades queued fragments by batched fragment shader and writes them to the framebuffer
  */
-void clear(GPUMemory&mem, ClearCommand cmd){
-  // Ukazatel na aktivovany framebuffer (zacatek + posun)
-  Framebuffer *fbp = mem.framebuffers + mem.activatedFramebuffer;
+void shadeFragments(Framebuffer& fb, Primitive const& primitive, TriangleSetup const& setup, DrawState const& state, ShaderInterface const& si, FragmentQueue& queue){
+  if(queue.count == 0)
+    return;
+
+  InFragmentBatch in;
+  in.count = queue.count;
+
+  // Perspektivne korektni vahy a gl_FragCoord, volne drahy opakuji posledni fragment
+  float w[3][shaderBatchSize];
+  for (uint32_t i = 0; i < shaderBatchSize; ++i){
+    uint32_t k = MIN(i, queue.count - 1);
+    w[0][i] = queue.barycentrics[k].lambda0 * setup.invW[0];
+    w[1][i] = queue.barycentrics[k].lambda1 * setup.invW[1];
+    w[2][i] = queue.barycentrics[k].lambda2 * setup.invW[2];
+    float s = 1.f / (w[0][i] + w[1][i] + w[2][i]);
+    w[0][i] *= s;
+    w[1][i] *= s;
+    w[2][i] *= s;
+
+    in.gl_FragCoord.v[0][i] = (float) queue.x[k] + 0.5f;
+    in.gl_FragCoord.v[1][i] = (float) queue.y[k] + 0.5f;
+    in.gl_FragCoord.v[2][i] = queue.z[k];
+    in.gl_FragCoord.v[3][i] = 1.f;
+  }
 
-  // Cisteni barvy framebufferu za predpokladu, ze data nejsou nullptr
-  if(cmd.clearColor && fbp->color.data != nullptr){ 
-    // Rozliseni obrazovky x*y ([x,y]) 
-    for (uint32_t y = 0; y < fbp->height; ++y){
-      for (uint32_t x = 0; x < fbp->width; ++x){
-        // Efektivni adresa
-        uint8_t* pixel = ((uint8_t*)fbp->color.data) + y*fbp->color.pitch + x*fbp->color.bytesPerPixel;
-        // Vycisteni barev
-        for (uint32_t i = 0; i < fbp->color.channels; ++i)
-          pixel[fbp->color.channelTypes[i]] = (uint8_t) (cmd.color[i] * 255);
-      }
-    }
+  // Interpolace po slozkach - hodnoty vrcholu jsou pro celou davku konstantni
+  for (uint32_t v = 0; v < state.varyings.nofSlots; ++v){
+    uint32_t a = state.varyings.slots[v];
+    float const* a0 = (float const*) &primitive.vertex[0].attributes[a];
+    float const* a1 = (float const*) &primitive.vertex[1].attributes[a];
+    float const* a2 = (float const*) &primitive.vertex[2].attributes[a];
+
+    for (uint32_t c = 0; c < state.varyings.components[v]; ++c)
+      for (uint32_t i = 0; i < shaderBatchSize; ++i)
+        in.attributes[a].v[c][i] = a0[c]*w[0][i] + a1[c]*w[1][i] + a2[c]*w[2][i];
   }
 
-  // Cisteni hloubky framebufferu za predpokladu, ze data nejsou nullptr
-  if(cmd.clearDepth && fbp->depth.data != nullptr){
-    // Rozliseni obrazovky x*y ([x,y])
-    for (uint32_t y = 0; y < fbp->height; ++y){
-      for (uint32_t x = 0; x < fbp->width; ++x){
-        // Efektivni adresa
-        float* pixel = (float*) ((uint8_t*)fbp->depth.data + y*fbp->depth.pitch + x*fbp->depth.bytesPerPixel);
-        // Vycisteni hloubky
-        *pixel = cmd.depth;
-      }
-    }
+  OutFragmentBatch out = {};
+
+  /// Fragment shader
+  fragmentOutputs.written = 0;
+  state.settings.fragmentShaderBatch(out, in, si);
+
+  /// PerFragmentOperace - nezahozene fragmenty jdou do ROP najednou
+  RopSpan span;
+  for (uint32_t i = 0; i < queue.count; ++i){
+    if(out.discard[i])
+      continue;
+    uint32_t k = span.count++;
+    span.color[k] = ropColor(out.gl_FragColor.v[0][i], out.gl_FragColor.v[1][i], out.gl_FragColor.v[2][i], out.gl_FragColor.v[3][i]);
+    span.z[k] = queue.z[i];
+    span.x[k] = queue.x[i];
+    span.y[k] = queue.y[i];
+    span.lane[k] = (uint8_t) i;
   }
+  ropSpan(fb, state, span);
+
+  queue.count = 0;
 }
 
-void subcommand(GPUMemory&mem, SubCommand cmd) {
-  CommandBuffer cb = *(cmd.commandBuffer);
+/**
+ * @brief This function shades one covered pixel and writes it to the framebuffer (or queues it for batched fragment shader)
+ */
+void fragment(Framebuffer& fb, Primitive const& primitive, TriangleSetup const& setup, DrawState const& state, ShaderInterface const& si, FragmentQueue* queue, Barycentric const& barycentrics, float z, int x, int y){
+  if(queue){
+    uint32_t k = queue->count++;
+    queue->barycentrics[k] = barycentrics;
+    queue->z[k] = z;
+    queue->x[k] = x;
+    queue->y[k] = y;
+    if(queue->count == shaderBatchSize)
+      shadeFragments(fb, primitive, setup, state, si, *queue);
+    return;
+  }
 
-    for(uint32_t i = 0; i < cb.nofCommands; ++i){
-      CommandType type = cb.commands[i].type;
-      CommandData data = cb.commands[i].data;
+  InFragment inFragment;
 
-      if(type == CommandType::CLEAR)
-        clear(mem, data.clearCommand);
+  // Stred pixelu a hloubka fragmentu
+  inFragment.gl_FragCoord.x = (float) x + 0.5f;
+  inFragment.gl_FragCoord.y = (float) y + 0.5f;
+  inFragment.gl_FragCoord.z = z;
 
-      if(type == CommandType::SET_DRAW_ID)
-        mem.gl_DrawID = data.setDrawIdCommand.id;
+  // Interpolace atributu fragmentu
+  fragment_attributes(primitive, setup, barycentrics, inFragment, state.varyings);
 
-      if(type == CommandType::DRAW)
-        draw(mem, data.drawCommand);      
+  OutFragment outFragment;
 
-      if(type == CommandType::BIND_FRAMEBUFFER)
-        mem.activatedFramebuffer = data.bindFramebufferCommand.id;
+  /// Fragment shader
+  fragmentOutputs.written = 0;
+  state.prg.fragmentShader(outFragment, inFragment, si);
 
-      if(type == CommandType::BIND_PROGRAM)
-        mem.activatedProgram = data.bindProgramCommand.id;
+  /// PerFragmentOperace
+  if(outFragment.discard)
+    return;
 
-      if(type == CommandType::BIND_VERTEXARRAY)
-        mem.activatedVertexArray = data.bindVertexArrayCommand.id;
+  // Orezani barvy do intervalu <0,1> a prevod na 8 bitu
+  RopSpan span;
+  span.count = 1;
+  span.color[0] = ropColor(outFragment.gl_FragColor[0], outFragment.gl_FragColor[1], outFragment.gl_FragColor[2], outFragment.gl_FragColor[3]);
+  span.z[0] = inFragment.gl_FragCoord.z;
+  span.x[0] = x;
+  span.y[0] = y;
+  span.lane[0] = 0;
+  ropSpan(fb, state, span);
+}
 
-      if(type == CommandType::SUB_COMMAND)
-        subcommand(mem, data.subCommand);
+#if IZG_AVX2
+/// Index nejnizsiho nastaveneho bitu masky (mask != 0)
+inline int lowestBit(uint32_t mask){
+#if defined(_MSC_VER)
+  unsigned long k;
+  _BitScanForward(&k, mask);
+  return (int) k;
+#else
+  return __builtin_ctz(mask);
+#endif
+}
 
-    }
+/// Index nejvyssiho nastaveneho bitu masky (mask != 0)
+inline int highestBit(uint32_t mask){
+#if defined(_MSC_VER)
+  unsigned long k;
+  _BitScanReverse(&k, mask);
+  return (int) k;
+#else
+  return 31 - __builtin_clz(mask);
+#endif
 }
 
-//! [izg_enqueue]
-void izg_enqueue(GPUMemory&mem,CommandBuffer const&cb){
-  (void)mem;
-  (void)cb;
-  /// \todo Tato funkce reprezentuje funkcionalitu grafické karty.<br>
-  /// Měla by umět zpracovat command buffer, čistit framebuffer a kreslit.<br>
-  /// mem obsahuje paměť grafické karty.
-  /// cb obsahuje command buffer pro zpracování.
-  /// Bližší informace jsou uvedeny na hlavní stránce dokumentace.
+/// Prevod int64 -> float pro |v| < 2^51 (pres presny double), shodne zaokrouhleni jako (float) v
+IZG_TARGET_AVX2 inline __m128 int64ToFloat(__m256i v){
+  __m256i const magicI = _mm256_set1_epi64x(0x4338000000000000);
+  __m256d const magicD = _mm256_set1_pd(6755399441055744.0);
+  return _mm256_cvtpd_ps(_mm256_sub_pd(_mm256_castsi256_pd(_mm256_add_epi64(v, magicI)), magicD));
+}
 
-  //Vynulovani pri kazdem volani funkce enqueue
-  mem.gl_DrawID = 0;
+/**
+ * @brief This function rasterizes triangle by blocks of 8 pixels in a row (AVX2)
+ *
+ * Coverage, barycentrics and depth are evaluated for all 8 pixels at once and with early
+ * depth test the depth is compared against the depth buffer. Only covered and depth
+ * passing pixels are shaded.
+ */
+IZG_TARGET_AVX2 void rasterizeAVX2(Framebuffer& fb, Primitive const& primitive, TriangleSetup const& setup, DrawState const& state, ShaderInterface const& si, FragmentQueue* queue, Rect const& r){
+  // Posun hranove funkce pro jednotlive pixely bloku (0..3 a 4..7) a pro cely blok
+  __m256i offLo[3], offHi[3];
+  int64_t step8[3];
+  for (uint32_t i = 0; i < 3; ++i){
+    int64_t stepX = setup.edge[i].a * subpixelOne;
+    offLo[i] = _mm256_setr_epi64x(0, stepX, 2*stepX, 3*stepX);
+    offHi[i] = _mm256_setr_epi64x(4*stepX, 5*stepX, 6*stepX, 7*stepX);
+    step8[i] = 8*stepX;
+  }
 
-  for(uint32_t i = 0; i < cb.nofCommands; ++i){
-      CommandType type = cb.commands[i].type;
-      CommandData data = cb.commands[i].data;
-      
-      if(type == CommandType::CLEAR){
-        clear(mem, data.clearCommand);
+  __m256 const invArea2 = _mm256_set1_ps(setup.invArea2);
+  __m256 const z0 = _mm256_set1_ps(primitive.vertex[0].gl_Position.z),
+               z1 = _mm256_set1_ps(primitive.vertex[1].gl_Position.z),
+               z2 = _mm256_set1_ps(primitive.vertex[2].gl_Position.z);
+  __m256i const lanes = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+
+  bool depthTest = (state.settings.earlyDepthTest || state.depthOnly) && fb.depth.data != nullptr;
+  __m256i const laneBits = _mm256_setr_epi32(1, 2, 4, 8, 16, 32, 64, 128);
+
+  int64_t px = (int64_t) r.x0 * subpixelOne + subpixelOne/2;
+
+  alignas(32) float lambda[3][8];
+  alignas(32) float depth[8];
+
+  for (int y = r.y0; y < r.y1; ++y)
+  {
+    int64_t py = (int64_t) y * subpixelOne + subpixelOne/2;
+    int64_t e[3];
+    for (uint32_t i = 0; i < 3; ++i)
+      e[i] = setup.edge[i].a * px + setup.edge[i].b * py + setup.edge[i].c;
+
+    float* depthRow = nullptr;
+    if(depthTest)
+      depthRow = (float*) getPixel(fb.depth, 0, fb.yReversed ? fb.height - y - 1 : y);
+
+    for (int x = r.x0; x < r.x1; x += 8, e[0] += step8[0], e[1] += step8[1], e[2] += step8[2])
+    {
+      __m256i lo[3], hi[3];
+      for (uint32_t i = 0; i < 3; ++i){
+        lo[i] = _mm256_add_epi64(_mm256_set1_epi64x(e[i]), offLo[i]);
+        hi[i] = _mm256_add_epi64(_mm256_set1_epi64x(e[i]), offHi[i]);
       }
 
-      if(type == CommandType::SET_DRAW_ID){
-        mem.gl_DrawID = data.setDrawIdCommand.id;
+      // Znamenkovy bit alespon jedne hranove funkce --> pixel je mimo trojuhelnik
+      int outside = _mm256_movemask_pd(_mm256_castsi256_pd(_mm256_or_si256(lo[0], _mm256_or_si256(lo[1], lo[2]))))
+                 | (_mm256_movemask_pd(_mm256_castsi256_pd(_mm256_or_si256(hi[0], _mm256_or_si256(hi[1], hi[2])))) << 4);
+
+      // Pixely za pravym okrajem obdelniku
+      __m256i valid = _mm256_cmpgt_epi32(_mm256_set1_epi32(r.x1 - x), lanes);
+      int mask = ~outside & _mm256_movemask_ps(_mm256_castsi256_ps(valid));
+      if(!mask)
+        continue;
+
+      __m256 l[3];
+      for (uint32_t i = 0; i < 3; ++i){
+        __m256i bias = _mm256_set1_epi64x(setup.edge[i].bias);
+        l[i] = _mm256_mul_ps(_mm256_set_m128(int64ToFloat(_mm256_add_epi64(hi[i], bias)), int64ToFloat(_mm256_add_epi64(lo[i], bias))), invArea2);
       }
 
-      if(type == CommandType::DRAW){
-        draw(mem, data.drawCommand);      
+      __m256 z = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(l[0], z0), _mm256_mul_ps(l[1], z1)), _mm256_mul_ps(l[2], z2));
+
+      // Hloubkovy test celeho bloku, cte se jen uvnitr obdelniku
+      if(depthTest){
+        __m256 stored = _mm256_maskload_ps(depthRow + x, valid);
+        mask &= _mm256_movemask_ps(_mm256_cmp_ps(z, stored, _CMP_LT_OQ));
+        if(!mask)
+          continue;
       }
 
-      if(type == CommandType::BIND_FRAMEBUFFER){
-        mem.activatedFramebuffer = data.bindFramebufferCommand.id;
+      // Jen hloubka: prosle pixely bloku se zapisou jednim maskovanym zapisem
+      if(state.depthOnly){
+        __m256i store = _mm256_cmpeq_epi32(_mm256_and_si256(_mm256_set1_epi32(mask), laneBits), laneBits);
+        _mm256_maskstore_ps(depthRow + x, store, z);
+        hiZWritten(state.hiZ, x + lowestBit(mask), y);
+        hiZWritten(state.hiZ, x + highestBit(mask), y);
+        continue;
       }
 
-      if(type == CommandType::BIND_PROGRAM){
-        mem.activatedProgram = data.bindProgramCommand.id;
+      for (uint32_t i = 0; i < 3; ++i)
+        _mm256_store_ps(lambda[i], l[i]);
+      _mm256_store_ps(depth, z);
+
+      for (; mask; mask &= mask - 1){
+        int k = lowestBit(mask);
+        Barycentric barycentrics;
+        barycentrics.lambda0 = lambda[0][k];
+        barycentrics.lambda1 = lambda[1][k];
+        barycentrics.lambda2 = lambda[2][k];
+        fragment(fb, primitive, setup, state, si, queue, barycentrics, depth[k], x + k, y);
       }
+    }
+  }
+}
 
-      if(type == CommandType::BIND_VERTEXARRAY){
-        mem.activatedVertexArray = data.bindVertexArrayCommand.id;
+/// Hranove funkce musi byt v celem obdelniku prevoditelne pres double (|E| < 2^51)
+bool fitsAVX2(TriangleSetup const& setup, Rect const& r){
+  int64_t const limit = int64_t(1) << 51;
+  int64_t xs[2] = {(int64_t) r.x0 * subpixelOne, (int64_t) (r.x1 + 8) * subpixelOne};
+  int64_t ys[2] = {(int64_t) r.y0 * subpixelOne, (int64_t) r.y1 * subpixelOne};
+  for (uint32_t i = 0; i < 3; ++i)
+    for (int64_t x : xs)
+      for (int64_t y : ys){
+        int64_t e = setup.edge[i].a * x + setup.edge[i].b * y + setup.edge[i].c;
+        if(e <= -limit || e >= limit)
+          return false;
       }
+  return true;
+}
+#endif
+
+void rasterizeScalar(Framebuffer& fb, Primitive const& primitive, TriangleSetup const& setup, DrawState const& state, ShaderInterface const& si, FragmentQueue* queue, Rect const& r) {
+  // Barycentricke souradnice
+  Barycentric barycentrics;
+
+  bool depthTest = (state.settings.earlyDepthTest || state.depthOnly) && fb.depth.data != nullptr;
+
+  // Hodnoty hranovych funkci ve stredu pixelu [x0, y0] a jejich prirustky o pixel v x a y
+  int64_t px = (int64_t) r.x0 * subpixelOne + subpixelOne/2,
+          py = (int64_t) r.y0 * subpixelOne + subpixelOne/2;
+  int64_t row[3], stepX[3], stepY[3];
+  for (uint32_t i = 0; i < 3; ++i){
+    row[i]   = setup.edge[i].a * px + setup.edge[i].b * py + setup.edge[i].c;
+    stepX[i] = setup.edge[i].a * subpixelOne;
+    stepY[i] = setup.edge[i].b * subpixelOne;
+  }
+
+  // Zmena souradnic [x,y] width * height
+  for (int y = r.y0; y < r.y1; ++y)
+  {
+    int64_t e0 = row[0], e1 = row[1], e2 = row[2];
 
-      if(type == CommandType::SUB_COMMAND){
-        subcommand(mem, data.subCommand);
+    for (int x = r.x0; x < r.x1; ++x, e0 += stepX[0], e1 += stepX[1], e2 += stepX[2])
+    {
+      // Pixel lezi v trojuhelniku, pokud jsou vsechny hranove funkce nezaporne
+      if((e0 | e1 | e2) < 0)
+        continue;
+
+      barycentrics.lambda0 = (float) (e0 + setup.edge[0].bias) * setup.invArea2;
+      barycentrics.lambda1 = (float) (e1 + setup.edge[1].bias) * setup.invArea2;
+      barycentrics.lambda2 = (float) (e2 + setup.edge[2].bias) * setup.invArea2;
+
+      float z = barycentrics.lambda0 * primitive.vertex[0].gl_Position.z + barycentrics.lambda1 * primitive.vertex[1].gl_Position.z + barycentrics.lambda2 * primitive.vertex[2].gl_Position.z;
+
+      // Early-Z: zakryty fragment se zahodi pred interpolaci atributu a fragment shaderem
+      if(depthTest){
+        float* depth = (float*) getPixel(fb.depth, x, fb.yReversed ? fb.height - y - 1 : y);
+        if(!(z < *depth))
+          continue;
+
+        // Jen hloubka: zapis bez fragment shaderu
+        if(state.depthOnly){
+          *depth = z;
+          hiZWritten(state.hiZ, x, y);
+          continue;
+        }
       }
+
+      fragment(fb, primitive, setup, state, si, queue, barycentrics, z, x, y);
     }
+
+    for (uint32_t i = 0; i < 3; ++i)
+      row[i] += stepY[i];
+  }
+}
+
+/**
+ * @brief This function returns maximal depth of hierarchical z block (recomputes it if it was written)
+ */
+float hiZBlockMax(Framebuffer const& fb, HierarchicalZ& hz, int bx, int by){
+  uint32_t b = by * hz.blocksX + bx;
+
+  if(hz.dirty[b]){
+    float m = -INFINITY;
+    int x1 = MIN((bx + 1) * hiZBlock, (int) fb.width),
+        y1 = MIN((by + 1) * hiZBlock, (int) fb.height);
+
+    for (int y = by * hiZBlock; y < y1; ++y){
+      float const* row = (float const*) getPixel(fb.depth, 0, fb.yReversed ? fb.height - y - 1 : y);
+      for (int x = bx * hiZBlock; x < x1; ++x)
+        m = MAX(m, row[x]);
+    }
+
+    hz.maxDepth[b] = m;
+    hz.dirty[b] = 0;
+  }
+
+  return hz.maxDepth[b];
+}
+
+/**
+ * @brief This function tests whether small triangle lies behind all blocks of hierarchical z it covers
+ */
+bool hiZOccluded(Framebuffer const& fb, HierarchicalZ& hz, TriangleSetup const& setup){
+  int bx0 = setup.bounds.x0 / hiZBlock, bx1 = (setup.bounds.x1 - 1) / hiZBlock,
+      by0 = setup.bounds.y0 / hiZBlock, by1 = (setup.bounds.y1 - 1) / hiZBlock;
+
+  if((uint32_t) ((bx1 - bx0 + 1) * (by1 - by0 + 1)) > hiZMaxTriangleBlocks)
+    return false;
+
+  for (int by = by0; by <= by1; ++by)
+    for (int bx = bx0; bx <= bx1; ++bx)
+      if(!(setup.zmin > hiZBlockMax(fb, hz, bx, by)))
+        return false;
+
+  return true;
+}
+
+void rasterize(Framebuffer& fb, Primitive const& primitive, TriangleSetup const& setup, DrawState const& state, Rect const& rect) {
+  // Boundary box trojuhelniku orezany na obdelnik (framebuffer nebo dlazdice)
+  Rect r;
+  r.x0 = MAX(setup.bounds.x0, rect.x0);
+  r.y0 = MAX(setup.bounds.y0, rect.y0);
+  r.x1 = MIN(setup.bounds.x1, rect.x1);
+  r.y1 = MIN(setup.bounds.y1, rect.y1);
+
+  if(r.x0 >= r.x1 || r.y0 >= r.y1)
+    return;
+
+  // Bez hloubky nema pruchod jen hloubky co zapsat
+  if(state.depthOnly && fb.depth.data == nullptr)
+    return;
+
+  ShaderInterface const& si = state.si;
+  DrawStateScope scope(state);
+  shadedPrimitive = &primitive;
+  shadedSetup = &setup;
+
+  // Davkovy fragment shader dostava fragmenty trojuhelniku po shaderBatchSize
+  FragmentQueue fragments;
+  FragmentQueue* queue = state.settings.fragmentShaderBatch && !state.depthOnly ? &fragments : nullptr;
+
+  auto rasterizeRect = [&](Rect const& part){
+#if IZG_AVX2
+    // Hloubka v bufferu musi byt float, aby se dala nacist po 8 pixelech
+    if(gpuSettings.simd && hasAVX2() && (fb.depth.data == nullptr || fb.depth.bytesPerPixel == sizeof(float)) && fitsAVX2(setup, part)){
+      rasterizeAVX2(fb, primitive, setup, state, si, queue, part);
+      return;
+    }
+#endif
+    rasterizeScalar(fb, primitive, setup, state, si, queue, part);
+  };
+
+  if(state.hiZ == nullptr)
+    rasterizeRect(r);
+  else {
+    // Bloky 8x8, ve kterych je vse ulozene blize nez trojuhelnik, se preskoci - sousedni viditelne bloky v radku se spoji
+    for (int by = r.y0 / hiZBlock; by * hiZBlock < r.y1; ++by){
+      Rect span;
+      span.y0 = MAX(r.y0, by * hiZBlock);
+      span.y1 = MIN(r.y1, (by + 1) * hiZBlock);
+      span.x0 = span.x1 = r.x0;
+
+      for (int bx = r.x0 / hiZBlock; bx * hiZBlock < r.x1; ++bx){
+        if(setup.zmin > hiZBlockMax(fb, *state.hiZ, bx, by)){
+          if(span.x0 < span.x1)
+            rasterizeRect(span);
+          span.x0 = span.x1 = MIN(r.x1, (bx + 1) * hiZBlock);
+        } else
+          span.x1 = MIN(r.x1, (bx + 1) * hiZBlock);
+      }
+
+      if(span.x0 < span.x1)
+        rasterizeRect(span);
+    }
+  }
+
+  // Zbytek fronty
+  if(queue)
+    shadeFragments(fb, primitive, setup, state, si, *queue);
+}
+
+/// Pocet vlaken (vcetne hlavniho) podle nastaveni, pracovni vlakna se pripadne vytvori
+uint32_t startWorkers(){
+  uint32_t nofThreads = gpuSettings.nofThreads ? gpuSettings.nofThreads : MAX(1u, std::thread::hardware_concurrency());
+  workerPool.resize(nofThreads - 1);
+  return nofThreads;
+}
+
+/// Obdelnik dlazdice tile v mrizce tileSize x tileSize orezany na framebuffer
+Rect tileRect(Framebuffer const& fb, uint32_t tileSize, uint32_t tilesX, uint32_t tile){
+  Rect rect;
+  rect.x0 = (tile % tilesX) * tileSize;
+  rect.y0 = (tile / tilesX) * tileSize;
+  rect.x1 = MIN(rect.x0 + (int) tileSize, (int) fb.width);
+  rect.y1 = MIN(rect.y0 + (int) tileSize, (int) fb.height);
+  return rect;
+}
+
+/// Vyplneni count pixelu vzorem pattern
+void fillSpan(uint8_t* dst, uint32_t count, uint8_t const* pattern, uint32_t bytesPerPixel){
+  if(bytesPerPixel == sizeof(uint32_t)){
+    uint32_t value;
+    std::memcpy(&value, pattern, sizeof(value));
+    std::fill_n((uint32_t*) dst, count, value);
+    return;
+  }
+
+  // Ostatni velikosti pixelu: zdvojovani jiz vyplnene casti
+  size_t total = (size_t) count * bytesPerPixel;
+  if(total == 0)
+    return;
+  std::memcpy(dst, pattern, bytesPerPixel);
+  for (size_t done = bytesPerPixel; done < total; done *= 2)
+    std::memcpy(dst + done, dst, MIN(done, total - done));
+}
+
+/// Vyplneni obdelniku (souradnice rasterizace) obrazu framebufferu vzorem
+void fillRect(Framebuffer const& fb, Image const& image, Rect const& r, uint8_t const* pattern){
+  for (int y = r.y0; y < r.y1; ++y){
+    uint32_t row = fb.yReversed ? fb.height - y - 1 : y;
+    fillSpan((uint8_t*) getPixel(image, r.x0, row), r.x1 - r.x0, pattern, image.bytesPerPixel);
+  }
+}
+
+/// Vyplneni celeho obrazu framebufferu vzorem, bloky radku paralelne
+void fillImage(Framebuffer const& fb, Image const& image, uint8_t const* pattern){
+  uint32_t nofJobs = (fb.height + clearRows - 1) / clearRows;
+  if(nofJobs > 1)
+    startWorkers();
+
+  workerPool.run(nofJobs, [&](uint32_t j){
+    Rect r;
+    r.x0 = 0;
+    r.x1 = (int) fb.width;
+    r.y0 = (int) (j * clearRows);
+    r.y1 = (int) MIN(fb.height, (j + 1) * clearRows);
+    fillRect(fb, image, r, pattern);
+  });
+}
+
+/// Vzor pixelu barvy, false = kanaly nepokryvaji cely pixel a musi se zapisovat po kanalech
+bool colorPattern(Image const& image, glm::vec4 const& color, uint8_t* pattern){
+  if(image.bytesPerPixel == 0 || image.bytesPerPixel > maxPixelBytes)
+    return false;
+
+  uint32_t covered = 0;
+  for (uint32_t i = 0; i < image.channels; ++i){
+    uint32_t offset = (uint32_t) image.channelTypes[i];
+    if(offset >= image.bytesPerPixel)
+      return false;
+    pattern[offset] = (uint8_t) (color[i] * 255);
+    covered |= 1u << offset;
+  }
+  return covered == (1u << image.bytesPerPixel) - 1;
+}
+
+/// Vyplneni odlozenych cisteni jedne dlazdice (prvni kresleni do ni), vraci vyplnene bity
+uint8_t resolveClearTile(LazyClear& lc, Framebuffer const& fb, uint32_t tile){
+  uint8_t bits = lc.tiles[tile];
+  if(bits == 0)
+    return 0;
+  lc.tiles[tile] = 0;
+
+  Rect rect = tileRect(fb, lc.tileSize, lc.tilesX, tile);
+  if(bits & clearColorBit)
+    fillRect(fb, fb.color, rect, lc.color);
+  if(bits & clearDepthBit)
+    fillRect(fb, fb.depth, rect, lc.depth);
+  return bits;
+}
+
+/// Kopie obdelniku (souradnice rasterizace) mezi obrazy dvou framebufferu se stejnym formatem pixelu
+void copyRect(Framebuffer const& dstFb, Image const& dst, Framebuffer const& srcFb, Image const& src, Rect const& r){
+  size_t bytes = (size_t) (r.x1 - r.x0) * src.bytesPerPixel;
+  for (int y = r.y0; y < r.y1; ++y)
+    std::memcpy(getPixel(dst, r.x0, dstFb.yReversed ? dstFb.height - y - 1 : y), getPixel(src, r.x0, srcFb.yReversed ? srcFb.height - y - 1 : y), bytes);
+}
+
+thread_local std::vector<uint8_t> tileBlock;
+
+/**
+ * @brief This function returns framebuffer whose images live in tile memory of the thread (GPUSettings::tileMemory)
+ *
+ * Color and depth of the tile share one block, rows are stored top-down in rasterization
+ * coordinates, so the view is addressed by the same x, y as the framebuffer and never flips.
+ */
+Framebuffer tileView(Framebuffer const& fb, Rect const& rect, uint32_t tileSize){
+  Framebuffer view = fb;
+  view.yReversed = false;
+
+  size_t colorBytes = fb.color.data ? ((size_t) tileSize * tileSize * fb.color.bytesPerPixel + 63) / 64 * 64 : 0;
+  size_t depthBytes = fb.depth.data ?  (size_t) tileSize * tileSize * fb.depth.bytesPerPixel : 0;
+  if(tileBlock.size() < colorBytes + depthBytes)
+    tileBlock.resize(colorBytes + depthBytes);
+
+  // Data posunuta o pocatek dlazdice, getPixel s globalnimi souradnicemi pak ukazuje do bloku
+  auto place = [&](Image& image, uint8_t* base){
+    image.pitch = tileSize * image.bytesPerPixel;
+    image.data = (void*) ((uintptr_t) base - (uintptr_t) rect.y0 * image.pitch - (uintptr_t) rect.x0 * image.bytesPerPixel);
+  };
+  if(colorBytes)
+    place(view.color, tileBlock.data());
+  if(depthBytes)
+    place(view.depth, tileBlock.data() + colorBytes);
+  return view;
+}
+
+/**
+ * @brief This function materializes all pending fast clears of framebuffer (in parallel)
+ *
+ * @param mem GPU memory
+ * @param id index of framebuffer
+ */
+void resolveClears(GPUMemory& mem, uint32_t id){
+  LazyClear& lc = lazyClear[id];
+  if(!lc.pending)
+    return;
+
+  startWorkers();
+  workerPool.run(lc.tilesX * lc.tilesY, [&](uint32_t tile){
+    resolveClearTile(lc, mem.framebuffers[id], tile);
+  });
+  lc.pending = false;
+}
+
+/**
+ * @brief This function rasterizes all binned triangles tile by tile (in parallel)
+ *
+ * @param mem GPU memory
+ */
+void flush(GPUMemory& mem){
+  if(binner.primitives.empty())
+    return;
+
+  startWorkers();
+
+  // Odlozene cisteni s jinou mrizkou dlazdic se musi vyplnit cele predem
+  uint32_t fbId = (uint32_t) (binner.fb - mem.framebuffers);
+  LazyClear& lc = lazyClear[fbId];
+  if(lc.pending && (lc.tileSize != binner.tileSize || lc.tilesX != binner.tilesX || lc.tilesY != binner.tilesY))
+    resolveClears(mem, fbId);
+
+  // Kazda dlazdice je samostatna uloha, v ramci dlazdice se zachovava poradi odeslani trojuhelniku
+  workerPool.run(binner.tilesX * binner.tilesY, [&](uint32_t tile){
+    if(binner.bins[tile].empty())
+      return;
+
+    Framebuffer& fb = *binner.fb;
+    Rect rect = tileRect(fb, binner.tileSize, binner.tilesX, tile);
+
+    // V lokalni pameti se dlazdice nacte jen jednou a zapise zpet az po vsech trojuhelnicich
+    Framebuffer view;
+    Framebuffer* target = &fb;
+    if(gpuSettings.tileMemory){
+      view = tileView(fb, rect, binner.tileSize);
+      target = &view;
+    }
+
+    // Dlazdice, do ktere se kresli, musi byt nejprve vycistena
+    uint8_t cleared = lc.pending ? resolveClearTile(lc, *target, tile) : 0;
+
+    if(gpuSettings.tileMemory){
+      if(fb.color.data && !(cleared & clearColorBit))
+        copyRect(view, view.color, fb, fb.color, rect);
+      if(fb.depth.data && !(cleared & clearDepthBit))
+        copyRect(view, view.depth, fb, fb.depth, rect);
+    }
+
+    for(uint32_t p : binner.bins[tile])
+      rasterize(*target, binner.primitives[p], binner.setups[p], binner.draws[binner.primitiveDraw[p]], rect);
+
+    // Zapis do linearniho (pripadne otoceneho) framebufferu
+    if(gpuSettings.tileMemory){
+      if(fb.color.data)
+        copyRect(fb, fb.color, view, view.color, rect);
+      if(fb.depth.data)
+        copyRect(fb, fb.depth, view, view.depth, rect);
+    }
+  });
+
+  binner.draws.clear();
+  binner.primitives.clear();
+  binner.setups.clear();
+  binner.primitiveDraw.clear();
+  for(auto& bin : binner.bins)
+    bin.clear();
+}
+
+void bin(Primitive const& primitive, TriangleSetup const& setup){
+  // Rozsah dlazdic pokryty boundary boxem trojuhelniku
+  int tileSize = (int) binner.tileSize;
+  int tx0 = setup.bounds.x0 / tileSize,
+      ty0 = setup.bounds.y0 / tileSize,
+      tx1 = (setup.bounds.x1 - 1) / tileSize,
+      ty1 = (setup.bounds.y1 - 1) / tileSize;
+
+  uint32_t p = (uint32_t) binner.primitives.size();
+  binner.primitives.push_back(primitive);
+  binner.setups.push_back(setup);
+  binner.primitiveDraw.push_back((uint32_t) binner.draws.size() - 1);
+
+  for (int ty = ty0; ty <= ty1; ++ty)
+    for (int tx = tx0; tx <= tx1; ++tx)
+      binner.bins[ty * binner.tilesX + tx].push_back(p);
+}
+
+/// Bity outcode vrcholu v clip-space: frustum a guard band
+enum ClipBits : uint32_t{
+  CLIP_LEFT   = 1 << 0,
+  CLIP_RIGHT  = 1 << 1,
+  CLIP_BOTTOM = 1 << 2,
+  CLIP_TOP    = 1 << 3,
+  CLIP_NEAR   = 1 << 4,
+  CLIP_FAR    = 1 << 5,
+  GUARD_LEFT  = 1 << 6,
+  GUARD_RIGHT = 1 << 7,
+  GUARD_BOTTOM= 1 << 8,
+  GUARD_TOP   = 1 << 9,
+  CLIP_FRUSTUM= CLIP_LEFT | CLIP_RIGHT | CLIP_BOTTOM | CLIP_TOP | CLIP_NEAR | CLIP_FAR,
+  CLIP_NEEDED = CLIP_NEAR | GUARD_LEFT | GUARD_RIGHT | GUARD_BOTTOM | GUARD_TOP,
+};
+
+uint32_t outcode(glm::vec4 const& p, float guardBand){
+  uint32_t code = 0;
+  if(p.x < -p.w) code |= CLIP_LEFT;
+  if(p.x >  p.w) code |= CLIP_RIGHT;
+  if(p.y < -p.w) code |= CLIP_BOTTOM;
+  if(p.y >  p.w) code |= CLIP_TOP;
+  if(p.z < -p.w) code |= CLIP_NEAR;
+  if(p.z >  p.w) code |= CLIP_FAR;
+  if(p.x < -guardBand*p.w) code |= GUARD_LEFT;
+  if(p.x >  guardBand*p.w) code |= GUARD_RIGHT;
+  if(p.y < -guardBand*p.w) code |= GUARD_BOTTOM;
+  if(p.y >  guardBand*p.w) code |= GUARD_TOP;
+  return code;
+}
+
+/**
+ * @brief This function interpolates clip-space vertex on an edge (only attributes passed to fragment shader)
+ */
+void interpolateVertex(OutVertex const& a, OutVertex const& b, float t, Program const& prg, OutVertex& out){
+  out.gl_Position = a.gl_Position + (b.gl_Position - a.gl_Position) * t;
+
+  for (uint32_t i = 0; i < maxAttributes; ++i){
+    AttributeType type = prg.vs2fs[i];
+
+    if(type == AttributeType::FLOAT)
+      out.attributes[i].v1 = a.attributes[i].v1 + (b.attributes[i].v1 - a.attributes[i].v1) * t;
+    else if(type == AttributeType::VEC2)
+      out.attributes[i].v2 = a.attributes[i].v2 + (b.attributes[i].v2 - a.attributes[i].v2) * t;
+    else if(type == AttributeType::VEC3)
+      out.attributes[i].v3 = a.attributes[i].v3 + (b.attributes[i].v3 - a.attributes[i].v3) * t;
+    else if(type == AttributeType::VEC4)
+      out.attributes[i].v4 = a.attributes[i].v4 + (b.attributes[i].v4 - a.attributes[i].v4) * t;
+    else if(type != AttributeType::EMPTY)
+      out.attributes[i] = a.attributes[i];
+  }
+}
+
+/**
+ * @brief This function clips convex polygon by plane dot(plane, gl_Position) >= 0 (Sutherland-Hodgman)
+ *
+ * @return number of output vertices
+ */
+uint32_t clipPolygon(OutVertex const* in, uint32_t n, OutVertex* out, glm::vec4 const& plane, Program const& prg){
+  uint32_t m = 0;
+
+  for (uint32_t i = 0; i < n; ++i){
+    OutVertex const& a = in[i];
+    OutVertex const& b = in[(i + 1) % n];
+    float da = glm::dot(plane, a.gl_Position),
+          db = glm::dot(plane, b.gl_Position);
+
+    if(da >= 0.f)
+      out[m++] = a;
+
+    // Hrana protina rovinu --> novy vrchol v pruseciku
+    if((da >= 0.f) != (db >= 0.f))
+      interpolateVertex(a, b, da / (da - db), prg, out[m++]);
+  }
+
+  return m;
+}
+
+/**
+ * @brief This function clips triangle by near plane and planes of guard band
+ *
+ * @param primitive triangle in clip-space
+ * @param code outcodes of vertices ored together
+ * @param out output triangles (triangle fan of clipped polygon)
+ *
+ * @return number of output triangles
+ */
+uint32_t clipTriangle(Primitive const& primitive, uint32_t code, float guardBand, Program const& prg, Primitive* out){
+  OutVertex polygon[2][maxClippedVertices];
+  uint32_t n = 3, current = 0;
+
+  for (uint32_t i = 0; i < 3; ++i)
+    polygon[0][i] = primitive.vertex[i];
+
+  // Near: z >= -w, guard band: |x|,|y| <= guardBand*w
+  std::pair<uint32_t, glm::vec4> const planes[] = {
+    {CLIP_NEAR,    glm::vec4( 0.f,  0.f, 1.f, 1.f      )},
+    {GUARD_LEFT,   glm::vec4( 1.f,  0.f, 0.f, guardBand)},
+    {GUARD_RIGHT,  glm::vec4(-1.f,  0.f, 0.f, guardBand)},
+    {GUARD_BOTTOM, glm::vec4( 0.f,  1.f, 0.f, guardBand)},
+    {GUARD_TOP,    glm::vec4( 0.f, -1.f, 0.f, guardBand)},
+  };
+
+  for (auto const& plane : planes){
+    if(!(code & plane.first))
+      continue;
+
+    n = clipPolygon(polygon[current], n, polygon[1 - current], plane.second, prg);
+    current = 1 - current;
+
+    if(n < 3)
+      return 0;
+  }
+
+  for (uint32_t i = 0; i + 2 < n; ++i){
+    out[i].vertex[0] = polygon[current][0];
+    out[i].vertex[1] = polygon[current][i + 1];
+    out[i].vertex[2] = polygon[current][i + 2];
+  }
+
+  return n - 2;
+}
+
+/**
+ * @brief This function runs vertex assembly and vertex shader for all vertices of a draw
+ *
+ * Indices are decoded first and every distinct gl_VertexID gets one slot in transformed
+ * buffer (post-transform cache). The slots are then shaded in parallel by the worker pool.
+ *
+ * @param mem GPU memory
+ * @param state draw state
+ * @param nofVertices number of vertex shader invocations of the draw
+ */
+/// Stinovani vrcholu transformed.ids[first, first+count) davkovym vertex shaderem
+void shadeVertices(DrawState const& state, ShaderInterface const& si, uint32_t first, uint32_t count){
+  InVertexBatch in;
+  in.count = count;
+  // Volne drahy opakuji posledni vrchol
+  for (uint32_t i = 0; i < shaderBatchSize; ++i)
+    in.gl_VertexID[i] = transformed.ids[first + MIN(i, count - 1)];
+
+  // Nacteni atributu z bufferu
+  vertex_attributes(fetchPlan, in);
+
+  OutVertexBatch out = {};
+
+  /// Vertex Shader --> out
+  state.settings.vertexShaderBatch(out, in, si);
+
+  // Zpet do OutVertex jen pozice a atributy predavane fragment shaderu
+  for (uint32_t i = 0; i < count; ++i){
+    OutVertex& outVertex = transformed.vertices[first + i];
+    outVertex.gl_Position = glm::vec4(out.gl_Position.v[0][i], out.gl_Position.v[1][i], out.gl_Position.v[2][i], out.gl_Position.v[3][i]);
+    for (uint32_t v = 0; v < state.varyings.nofSlots; ++v){
+      uint32_t a = state.varyings.slots[v];
+      for (uint32_t c = 0; c < state.varyings.components[v]; ++c)
+        ((float*) &outVertex.attributes[a])[c] = out.attributes[a].v[c][i];
+    }
+  }
+}
+
+void shadeTransformed(DrawState const& state, uint32_t nofUnique, uint32_t nofVertices);
+
+void vertexStage(GPUMemory& mem, DrawState const& state, uint32_t nofVertices){
+  // Bez indexu se zadny vrchol neopakuje, cache by jen zdrzovala
+  bool cache = gpuSettings.vertexCache && mem.vertexArrays[mem.activatedVertexArray].indexBufferID != -1;
+  if(cache && ++transformed.current == 0){
+    // Pretekl citac DRAW, stare znacky by mohly kolidovat
+    std::fill(transformed.stamp.begin(), transformed.stamp.end(), 0);
+    transformed.current = 1;
+  }
+
+  // VertexArray aktivovany v predchozim enqueue
+  if(fetchPlan.vertexArray != (int32_t) mem.activatedVertexArray)
+    compileVertexArray(mem, mem.activatedVertexArray);
+
+  // Dalsi instance maji stejne vrcholy, sestaveni z prvni instance se pouzije znovu
+  if(state.instance > 0){
+    shadeTransformed(state, (uint32_t) transformed.ids.size(), nofVertices);
+    return;
+  }
+
+  /// Vertex Assembly - sestaveni vrcholu
+  // Indexing, i = invokace vertex shaderu, dekoduji se vsechny indexy najednou
+  transformed.ids.clear();
+  transformed.elements.resize(nofVertices);
+  indexing(fetchPlan, 0, nofVertices, transformed.elements.data());
+
+  for (uint32_t i = 0; i < nofVertices; ++i)
+  {
+    uint32_t id = transformed.elements[i];
+    if(cache){
+      if(id >= transformed.stamp.size()){
+        transformed.stamp.resize(id + 1, 0);
+        transformed.slot.resize(id + 1);
+      }
+
+      // Vrchol uz v tomto DRAW ma slot
+      if(transformed.stamp[id] == transformed.current){
+        transformed.elements[i] = transformed.slot[id];
+        continue;
+      }
+
+      transformed.stamp[id] = transformed.current;
+      transformed.slot[id] = (uint32_t) transformed.ids.size();
+    }
+
+    transformed.elements[i] = (uint32_t) transformed.ids.size();
+    transformed.ids.push_back(id);
+  }
+
+  shadeTransformed(state, (uint32_t) transformed.ids.size(), nofVertices);
+}
+
+/// Vertex shader pro vsechny sestavene vrcholy (transformed.ids) paralelne
+void shadeTransformed(DrawState const& state, uint32_t nofUnique, uint32_t nofVertices){
+  if(transformed.vertices.size() < nofUnique)
+    transformed.vertices.resize(nofUnique);
+
+  executionStatistics.vertexShaderInvocations += nofUnique;
+  executionStatistics.vertexCacheHits += nofVertices - nofUnique;
+
+  ShaderInterface const& si = state.si;
+
+  // Vrcholy se stinuji po blocich, vysledek nezavisi na poradi zpracovani
+  uint32_t const chunk = 64;
+  uint32_t nofChunks = (nofUnique + chunk - 1) / chunk;
+
+  if(nofChunks > 1)
+    startWorkers();
+
+  workerPool.run(nofChunks, [&](uint32_t c){
+    uint32_t end = MIN(nofUnique, (c + 1) * chunk);
+    DrawStateScope scope(state);
+
+    if(state.settings.vertexShaderBatch){
+      for (uint32_t v = c * chunk; v < end; v += shaderBatchSize)
+        shadeVertices(state, si, v, MIN(shaderBatchSize, end - v));
+      return;
+    }
+
+    for (uint32_t v = c * chunk; v < end; ++v){
+      InVertex inVertex;
+      inVertex.gl_VertexID = transformed.ids[v];
+
+      // Nacteni atributu z bufferu
+      vertex_attributes(fetchPlan, inVertex);
+
+      /// Vertex Shader --> outVertex
+      state.prg.vertexShader(transformed.vertices[v], inVertex, si);
+    }
+  });
+}
+
+/// Render target (textura id) s pameti velikosti framebufferu (pri zmene velikosti nova, vynulovana), nullptr pokud neni nastaven
+Image const* renderTarget(GPUMemory& mem, uint32_t framebuffer, int32_t id){
+  Framebuffer const& fb = mem.framebuffers[framebuffer];
+  if(id < 0 || id >= (int32_t) nofTextures || fb.width == 0 || fb.height == 0)
+    return nullptr;
+
+  std::vector<glm::vec4>& storage = renderTargetStorage[id];
+  if(storage.size() != (size_t) fb.width * fb.height){
+    // Rozpracovane dlazdice zapisuji do stare pameti, tu mohou cist jeste textury odeslanych kopii pameti
+    flush(mem);
+    if(!storage.empty())
+      retiredTargets.push_back(std::move(storage));
+    storage.assign((size_t) fb.width * fb.height, glm::vec4(0.f));
+  }
+
+  // Popis textury v provadene pameti, ostatni DRAW ji ctou pres mem.textures
+  Texture& texture = mem.textures[id];
+  if(texture.img.data != storage.data() || texture.width != fb.width || texture.height != fb.height){
+    texture = Texture();
+    texture.img.data = storage.data();
+    texture.img.pitch = fb.width * sizeof(glm::vec4);
+    texture.img.bytesPerPixel = sizeof(glm::vec4);
+    texture.img.channels = 4;
+    texture.img.format = Image::FLOAT32;
+    texture.width = fb.width;
+    texture.height = fb.height;
+  }
+  return &texture.img;
+}
+
+/// Render targety aktivovaneho programu v aktivovanem framebufferu
+void bindRenderTargets(GPUMemory& mem, Image const** targets){
+  int32_t const* ids = executed->programs[mem.activatedProgram].renderTargets;
+  for (uint32_t t = 0; t < maxRenderTargets; ++t)
+    targets[t] = renderTarget(mem, mem.activatedFramebuffer, ids[t]);
+}
+
+void draw(GPUMemory& mem, DrawCommand cmd, uint32_t instance = 0){
+  Framebuffer& fb = mem.framebuffers[mem.activatedFramebuffer];
+
+  DrawState state;
+  state.prg = mem.programs[mem.activatedProgram];
+
+  // Program aktivovany v predchozim enqueue
+  if(varyingPlan.program != (int32_t) mem.activatedProgram)
+    compileProgram(mem, mem.activatedProgram);
+  state.varyings = varyingPlan;
+  state.settings = executed->programs[mem.activatedProgram];
+  state.gl_DrawID = mem.gl_DrawID;
+  state.instance = instance;
+  state.backfaceCulling = cmd.backfaceCulling;
+  state.depthOnly = state.settings.depthOnly;
+  bindRenderTargets(mem, state.targets);
+
+  /// Shader interface - rozhrani shaderu
+  state.si.gl_DrawID = state.gl_DrawID;
+  state.si.uniforms = mem.uniforms;
+  state.si.textures = mem.textures;
+
+  // Uniformy spolecne vsem vrcholum a fragmentum DRAW se pripravi jednou
+  if(state.settings.prepare){
+    DrawStateScope scope(state);
+    state.settings.prepare(state.constants, state.si);
+  }
+
+  bool binning = gpuSettings.binning && fb.width > 0 && fb.height > 0;
+
+  if(binning){
+    // Zmena framebufferu nebo velikosti dlazdic --> nejprve se dokresli rozpracovane dlazdice
+    uint32_t tileSize = MAX(1u, gpuSettings.tileSize);
+    if(binner.fb != &fb || binner.tileSize != tileSize || binner.tilesX != (fb.width + tileSize - 1) / tileSize || binner.tilesY != (fb.height + tileSize - 1) / tileSize){
+      flush(mem);
+      binner.fb = &fb;
+      binner.tileSize = tileSize;
+      binner.tilesX = (fb.width + tileSize - 1) / tileSize;
+      binner.tilesY = (fb.height + tileSize - 1) / tileSize;
+      binner.bins.resize(binner.tilesX * binner.tilesY);
+    }
+  } else {
+    // Bez dlazdic se kresli primo, odlozena cisteni se vyplni hned
+    resolveClears(mem, mem.activatedFramebuffer);
+  }
+
+  // Hierarchicka hloubka je platna jen po CLEAR v tomto enqueue, bloky nesmi presahovat hranice dlazdic
+  state.hiZ = nullptr;
+  HierarchicalZ& hz = hiZ[&fb - mem.framebuffers];
+  if(gpuSettings.hierarchicalZ && (state.settings.earlyDepthTest || state.depthOnly) && hz.depth != nullptr && hz.depth == fb.depth.data && fb.depth.bytesPerPixel == sizeof(float) &&
+     hz.blocksX == (fb.width + hiZBlock - 1) / hiZBlock && hz.blocksY == (fb.height + hiZBlock - 1) / hiZBlock &&
+     (!binning || binner.tileSize % hiZBlock == 0))
+    state.hiZ = &hz;
+
+  if(binning)
+    binner.draws.push_back(state);
+
+  /// Vertex stage - vsechny vrcholy DRAW se spocitaji paralelne do transformed
+  vertexStage(mem, state, cmd.nofVertices);
+
+  // Guard band: trojuhelniky uvnitr se neorezavaji, souradnice po viewport transformaci se jeste vejdou do pevne radove carky
+  float guardBand = (float) (subpixelLimit / subpixelOne) / (float) MAX(1u, MAX(fb.width, fb.height));
+
+  // Perspektivni deleni, viewport transformace, setup a rasterizace trojuhelniku
+  auto triangle = [&](Primitive& primitive){
+    // w <= 0 by se objevilo jen u projekce, ktera nesvazuje near rovinu s w
+    if(!(primitive.vertex[0].gl_Position.w > 0.f && primitive.vertex[1].gl_Position.w > 0.f && primitive.vertex[2].gl_Position.w > 0.f))
+      return;
+
+    prespective_division(primitive);
+    viewport_transformation(fb, primitive);
+
+    TriangleSetup setup;
+    if(!setupTriangle(fb, primitive, setup))
+      return;
+
+    // backface culling a trojuhelnik je clock wise, vykresleni se neprovede
+    if(state.backfaceCulling && setup.clockwise)
+      return;
+
+    // Maly trojuhelnik cely za ulozenou hloubkou se zahodi jeste pred rasterizaci
+    if(state.hiZ && hiZOccluded(fb, *state.hiZ, setup))
+      return;
+
+    if(binning)
+      bin(primitive, setup);
+    else
+      rasterize(fb, primitive, setup, state, setup.bounds);
+  };
+
+  /// Primitive assembly - trojice vrcholu z transformed
+  Primitive primitive;
+
+  for (uint32_t i = 0; i < cmd.nofVertices; ++i)
+  {
+    primitive.vertex[i % 3] = transformed.vertices[transformed.elements[i]];
+
+    /// Mame-li 3 vrcholy --> clipping, perspektivni deleni, viewport transformace, rasterizace, ...
+    if((i+1) % 3 == 0) {
+      uint32_t c0 = outcode(primitive.vertex[0].gl_Position, guardBand),
+               c1 = outcode(primitive.vertex[1].gl_Position, guardBand),
+               c2 = outcode(primitive.vertex[2].gl_Position, guardBand);
+
+      // Vsechny vrcholy za stejnou rovinou frusta --> trivialni zamitnuti
+      if(c0 & c1 & c2 & CLIP_FRUSTUM){
+        ++executionStatistics.primitivesRejected;
+        continue;
+      }
+
+      // Uvnitr near roviny i guard bandu --> bez orezavani
+      if(((c0 | c1 | c2) & CLIP_NEEDED) == 0){
+        triangle(primitive);
+        continue;
+      }
+
+      ++executionStatistics.primitivesClipped;
+
+      Primitive clipped[maxClippedVertices - 2];
+      uint32_t nofClipped = clipTriangle(primitive, c0 | c1 | c2, guardBand, state.prg, clipped);
+      for (uint32_t t = 0; t < nofClipped; ++t)
+        triangle(clipped[t]);
+    }
+  }
+
+  //Inkrementace DrawID po kazdem prikazu vykreslovani
+  ++mem.gl_DrawID;
+}
+
+/// Data prikazu rozsireni (ulozena v Command::data pres izg_pushCommand)
+template<typename Data>
+Data commandData(Command const& command){
+  Data data;
+  std::memcpy((void*) &data, &command.data, sizeof(Data));
+  return data;
+}
+
+/// Vsechny instance maji stejne gl_DrawID, po prikazu se zvysi jednou
+void drawInstanced(GPUMemory& mem, DrawInstancedCommand const& cmd){
+  DrawCommand drawCmd;
+  drawCmd.nofVertices = cmd.nofVertices;
+  drawCmd.backfaceCulling = cmd.backfaceCulling;
+
+  uint32_t drawID = mem.gl_DrawID;
+  for (uint32_t i = 0; i < cmd.nofInstances; ++i){
+    mem.gl_DrawID = drawID;
+    draw(mem, drawCmd, i);
+  }
+  mem.gl_DrawID = drawID + 1;
+}
+
+/// MULTI_DRAW ve zkompilovanem command bufferu, zaznamy (a hierarchie boxu) jsou v CompiledCommandBuffer
+struct CompiledMultiDraw{
+  uint32_t first         = 0 ;
+  uint32_t nofRecords    = 0 ;
+  int32_t  cullUniform   = -1;
+  uint32_t firstCullNode = 0 ; // koren hierarchie (jen pri cullUniform >= 0)
+};
+
+/// Poloha boxu vuci frustu: 0 = cely venku, 1 = protina, 2 = cely uvnitr
+int frustumTest(BoundingBox const& box, glm::mat4 const& projView){
+  if(!(box.min.x <= box.max.x))
+    return 0;
+  if(!std::isfinite(box.min.x) || !std::isfinite(box.max.x))
+    return 1;
+
+  uint32_t outAll = 63, outAny = 0;
+  for (uint32_t c = 0; c < 8; ++c){
+    glm::vec3 corner(c & 1 ? box.max.x : box.min.x, c & 2 ? box.max.y : box.min.y, c & 4 ? box.max.z : box.min.z);
+    glm::vec4 p = projView * glm::vec4(corner, 1.f);
+    uint32_t out = (p.x < -p.w) | (p.x > p.w) << 1 | (p.y < -p.w) << 2 | (p.y > p.w) << 3 | (p.z < -p.w) << 4 | (p.z > p.w) << 5;
+    outAll &= out;
+    outAny |= out;
+  }
+  return outAll ? 0 : outAny ? 1 : 2;
+}
+
+/// Kresleni instanci first..first+count-1 zaznamu
+void drawRecord(GPUMemory& mem, DrawRecord const& record, uint32_t first, uint32_t count){
+  DrawInstancedCommand drawCmd;
+  drawCmd.nofVertices = record.nofVertices;
+  drawCmd.nofInstances = count;
+  drawCmd.backfaceCulling = record.backfaceCulling;
+  mem.gl_DrawID = record.drawID + first;
+  drawInstanced(mem, drawCmd);
+}
+
+std::vector<uint8_t> culledObjects; // objekty (drawID + instance) orezane v provadenem MULTI_DRAW
+
+/// Orezani hierarchie: podstrom cely venku oreze vsechny sve objekty, cely uvnitr je ponecha bez dalsich testu
+void cullHierarchy(CullNode const* nodes, glm::mat4 const& projView){
+  for (uint32_t i = 0; i < nodes[0].end;){
+    CullNode const& node = nodes[i];
+    int test = frustumTest(node.bounds, projView);
+    if(test == 0)
+      for (uint32_t n = i; n < node.end; ++n)
+        if(nodes[n].object >= 0 && (uint32_t) nodes[n].object < culledObjects.size())
+          culledObjects[nodes[n].object] = 1;
+    if(test != 1){
+      i = node.end;
+      continue;
+    }
+
+    // Podstrom protina frustum: rozhodne box objektu uzlu, potomci se testuji dal
+    if(node.object >= 0 && (uint32_t) node.object < culledObjects.size() && !frustumTest(node.objectBox, projView))
+      culledObjects[node.object] = 1;
+    ++i;
+  }
+}
+
+void multiDraw(GPUMemory& mem, CompiledCommandBuffer const& compiled, CompiledMultiDraw const& cmd){
+  // Orezani proti kamere platne pri provadeni, ne pri priprave command bufferu
+  bool cull = cmd.cullUniform >= 0;
+  if(cull){
+    uint32_t nofObjects = 0;
+    for (uint32_t r = 0; r < cmd.nofRecords; ++r){
+      DrawRecord const& record = compiled.records[cmd.first + r];
+      nofObjects = MAX(nofObjects, record.drawID + record.nofInstances);
+    }
+    culledObjects.assign(nofObjects, 0);
+    cullHierarchy(compiled.cullNodes.data() + cmd.firstCullNode, mem.uniforms[cmd.cullUniform].m4);
+  }
+
+  // Render targety plati i kdyz se po orezani nic nekresli, dalsi pruchody je ctou
+  Image const* targets[maxRenderTargets];
+  bindRenderTargets(mem, targets);
+
+  for (uint32_t r = 0; r < cmd.nofRecords; ++r){
+    DrawRecord const& record = compiled.records[cmd.first + r];
+    uint8_t const* culled = cull ? culledObjects.data() + record.drawID : nullptr;
+
+    // Sousedni zaznamy stejneho VertexArray sdili plan nacitani vrcholu
+    mem.activatedVertexArray = record.vertexArray;
+
+    // Useky neorezanych instanci
+    uint32_t run = 0;
+    for (uint32_t k = 0; k <= record.nofInstances; ++k){
+      if(k < record.nofInstances && !(culled && culled[k])){
+        ++run;
+        continue;
+      }
+      if(k < record.nofInstances)
+        ++executionStatistics.instancesCulled;
+      if(run == 0)
+        continue;
+      if(fetchPlan.vertexArray != (int32_t) record.vertexArray)
+        compileVertexArray(mem, record.vertexArray);
+      drawRecord(mem, record, k - run, run);
+      run = 0;
+    }
+    mem.gl_DrawID = record.drawID + 1;
+  }
+}
+
+/**
+ * @brief This function clears the framebuffer (helper function)
+ * 
+ * @param GPU memory
+ * @param Clear Command
+ */
+void clear(GPUMemory&mem, ClearCommand cmd){
+  // Rozpracovane dlazdice musi byt vykresleny pred cistenim
+  flush(mem);
+
+  // Ukazatel na aktivovany framebuffer (zacatek + posun)
+  Framebuffer *fbp = mem.framebuffers + mem.activatedFramebuffer;
+  LazyClear& lc = lazyClear[mem.activatedFramebuffer];
+
+  bool clearColor = cmd.clearColor && fbp->color.data != nullptr;
+  bool clearDepth = cmd.clearDepth && fbp->depth.data != nullptr;
+
+  // Vzory pixelu - barva i hloubka se pak jen kopiruji
+  uint8_t color[maxPixelBytes], depth[sizeof(float)];
+  bool colorFill = clearColor && colorPattern(fbp->color, cmd.color, color);
+  bool depthFill = clearDepth && fbp->depth.bytesPerPixel == sizeof(float);
+  std::memcpy(depth, &cmd.depth, sizeof(float));
+
+  // Rychle cisteni: dlazdice se jen oznaci a vyplni az pri prvnim kresleni nebo na konci enqueue
+  uint8_t lazy = 0;
+  if(gpuSettings.fastClear && fbp->width > 0 && fbp->height > 0)
+    lazy = (colorFill ? clearColorBit : 0) | (depthFill ? clearDepthBit : 0);
+
+  if(lazy){
+    uint32_t tileSize = MAX(1u, gpuSettings.tileSize);
+    uint32_t tilesX = (fbp->width + tileSize - 1) / tileSize, tilesY = (fbp->height + tileSize - 1) / tileSize;
+    if(lc.pending && (lc.tileSize != tileSize || lc.tilesX != tilesX || lc.tilesY != tilesY))
+      resolveClears(mem, mem.activatedFramebuffer);
+
+    if(!lc.pending)
+      lc.tiles.assign(tilesX * tilesY, 0);
+    lc.tileSize = tileSize;
+    lc.tilesX = tilesX;
+    lc.tilesY = tilesY;
+    lc.pending = true;
+
+    if(lazy & clearColorBit)
+      std::memcpy(lc.color, color, fbp->color.bytesPerPixel);
+    if(lazy & clearDepthBit)
+      std::memcpy(lc.depth, depth, sizeof(float));
+    for (auto& t : lc.tiles)
+      t |= lazy;
+  }
+
+  // Okamzite cisteni prepisuje i odlozene cisteni stejneho bufferu
+  uint8_t now = ((clearColor ? clearColorBit : 0) | (clearDepth ? clearDepthBit : 0)) & ~lazy;
+  if(lc.pending && now)
+    for (auto& t : lc.tiles)
+      t &= ~now;
+
+  // Cisteni barvy framebufferu za predpokladu, ze data nejsou nullptr
+  if(now & clearColorBit){
+    if(colorFill)
+      fillImage(*fbp, fbp->color, color);
+    else {
+      // Kanaly nepokryvaji cely pixel, zapisuje se po kanalech
+      for (uint32_t y = 0; y < fbp->height; ++y){
+        for (uint32_t x = 0; x < fbp->width; ++x){
+          // Efektivni adresa
+          uint8_t* pixel = ((uint8_t*)fbp->color.data) + y*fbp->color.pitch + x*fbp->color.bytesPerPixel;
+          // Vycisteni barev
+          for (uint32_t i = 0; i < fbp->color.channels; ++i)
+            pixel[fbp->color.channelTypes[i]] = (uint8_t) (cmd.color[i] * 255);
+        }
+      }
+    }
+  }
+
+  // Cisteni hloubky framebufferu za predpokladu, ze data nejsou nullptr
+  if(now & clearDepthBit){
+    if(depthFill)
+      fillImage(*fbp, fbp->depth, depth);
+    else {
+      for (uint32_t y = 0; y < fbp->height; ++y)
+        for (uint32_t x = 0; x < fbp->width; ++x)
+          *(float*) getPixel(fbp->depth, x, y) = cmd.depth;
+    }
+  }
+
+  if(clearDepth){
+    // Po vycisteni je maximum kazdeho bloku presne hloubka cisteni
+    HierarchicalZ& hz = hiZ[mem.activatedFramebuffer];
+    hz.blocksX = (fbp->width + hiZBlock - 1) / hiZBlock;
+    hz.blocksY = (fbp->height + hiZBlock - 1) / hiZBlock;
+    hz.maxDepth.assign(hz.blocksX * hz.blocksY, cmd.depth);
+    hz.dirty.assign(hz.blocksX * hz.blocksY, 0);
+    hz.depth = fbp->depth.data;
+  }
+}
+
+/// Vyplneni render targetu aktivovaneho programu v aktivovanem framebufferu (radky textury odpovidaji radkum rasterizace)
+void clearTargets(GPUMemory& mem, ClearTargetsCommand const& cmd){
+  // Rozpracovane dlazdice do render targetu jeste zapisuji
+  flush(mem);
+
+  Image const* targets[maxRenderTargets];
+  bindRenderTargets(mem, targets);
+  Framebuffer rows = mem.framebuffers[mem.activatedFramebuffer];
+  rows.yReversed = false;
+  for (uint32_t t = 0; t < maxRenderTargets; ++t)
+    if(targets[t])
+      fillImage(rows, *targets[t], (uint8_t const*) &cmd.value);
+}
+
+/// Stav nastavovany prikazy BIND_* a SET_DRAW_ID (index do commandStates)
+enum CommandState : uint32_t{
+  STATE_FRAMEBUFFER,
+  STATE_PROGRAM,
+  STATE_VERTEXARRAY,
+  STATE_DRAW_ID,
+  NOF_COMMAND_STATES,
+};
+
+/// Kompilace command bufferu: zmeny stavu se odkladaji az k prikazu, ktery je pouzije
+struct CommandCompiler{
+  std::vector<Command>&     out;
+  std::vector<DrawRecord>&  records;
+  std::vector<CullNode>&    cullNodes;
+  int64_t wanted [NOF_COMMAND_STATES] = {-1, -1, -1, 0}; // posledni pozadovana hodnota, -1 = zadna
+  int64_t emitted[NOF_COMMAND_STATES] = {-1, -1, -1, 0}; // hodnota pri provadeni, -1 = neznama (z predchoziho izg_enqueue)
+};
+
+/// Zapis odlozene zmeny stavu, pokud se lisi od jiz zapsane
+void emitState(CommandCompiler& cc, CommandState state){
+  if(cc.wanted[state] < 0 || cc.wanted[state] == cc.emitted[state])
+    return;
+
+  uint32_t id = (uint32_t) cc.wanted[state];
+  Command command;
+  switch(state){
+    case STATE_FRAMEBUFFER: command.type = CommandType::BIND_FRAMEBUFFER; command.data.bindFramebufferCommand.id = id; break;
+    case STATE_PROGRAM    : command.type = CommandType::BIND_PROGRAM    ; command.data.bindProgramCommand.id     = id; break;
+    case STATE_VERTEXARRAY: command.type = CommandType::BIND_VERTEXARRAY; command.data.bindVertexArrayCommand.id = id; break;
+    default               : command.type = CommandType::SET_DRAW_ID     ; command.data.setDrawIdCommand.id       = id; break;
+  }
+  cc.out.push_back(command);
+  cc.emitted[state] = cc.wanted[state];
+}
+
+/// DRAW zvysuje gl_DrawID (neznama hodnota zustava neznama)
+void advanceDrawID(CommandCompiler& cc){
+  if(cc.wanted[STATE_DRAW_ID] >= 0)
+    ++cc.wanted[STATE_DRAW_ID];
+  if(cc.emitted[STATE_DRAW_ID] >= 0)
+    ++cc.emitted[STATE_DRAW_ID];
+}
+
+/// Prikazy rozsireni (DRAW_INSTANCED, MULTI_DRAW, CLEAR_TARGETS)
+void compileExtension(CommandCompiler& cc, Command const& command){
+  if(command.type == CLEAR_TARGETS){
+    // Render targety urcuje program, velikost framebuffer
+    emitState(cc, STATE_FRAMEBUFFER);
+    emitState(cc, STATE_PROGRAM);
+    cc.out.push_back(command);
+  }
+
+  if(command.type == DRAW_INSTANCED){
+    for (uint32_t state = 0; state < NOF_COMMAND_STATES; ++state)
+      emitState(cc, (CommandState) state);
+    cc.out.push_back(command);
+    advanceDrawID(cc);
+  }
+
+  if(command.type == MULTI_DRAW){
+    MultiDrawCommand multi = commandData<MultiDrawCommand>(command);
+    if(multi.nofRecords == 0)
+      return;
+    emitState(cc, STATE_FRAMEBUFFER);
+    emitState(cc, STATE_PROGRAM);
+
+    // Zaznamy se kopiruji, zkompilovany prikaz obsahuje jen jejich rozsah
+    CompiledMultiDraw compiled;
+    compiled.first = (uint32_t) cc.records.size();
+    compiled.nofRecords = multi.nofRecords;
+    cc.records.insert(cc.records.end(), multi.records, multi.records + multi.nofRecords);
+
+    // Hierarchie boxu se kopiruje cela, orezava se pri provadeni
+    if(multi.cullUniform >= 0 && multi.cullNodes){
+      compiled.cullUniform = multi.cullUniform;
+      compiled.firstCullNode = (uint32_t) cc.cullNodes.size();
+      cc.cullNodes.insert(cc.cullNodes.end(), multi.cullNodes, multi.cullNodes + multi.cullNodes[0].end);
+    }
+
+    Command out;
+    out.type = MULTI_DRAW;
+    std::memcpy((void*) &out.data, &compiled, sizeof(compiled));
+    cc.out.push_back(out);
+
+    // Zaznamy samy nastavuji VertexArray a gl_DrawID, stav po prikazu se nesleduje
+    cc.wanted[STATE_VERTEXARRAY] = cc.emitted[STATE_VERTEXARRAY] = -1;
+    cc.wanted[STATE_DRAW_ID    ] = cc.emitted[STATE_DRAW_ID    ] = -1;
+  }
+}
+
+void compileCommands(CommandCompiler& cc, CommandBuffer const& cb){
+  for(uint32_t i = 0; i < cb.nofCommands; ++i){
+    Command const& command = cb.commands[i];
+    switch(command.type){
+      case CommandType::CLEAR:
+        emitState(cc, STATE_FRAMEBUFFER);
+        cc.out.push_back(command);
+        break;
+      case CommandType::DRAW:
+        for (uint32_t state = 0; state < NOF_COMMAND_STATES; ++state)
+          emitState(cc, (CommandState) state);
+        cc.out.push_back(command);
+        advanceDrawID(cc);
+        break;
+      case CommandType::SET_DRAW_ID     : cc.wanted[STATE_DRAW_ID    ] = command.data.setDrawIdCommand.id      ; break;
+      case CommandType::BIND_FRAMEBUFFER: cc.wanted[STATE_FRAMEBUFFER] = command.data.bindFramebufferCommand.id; break;
+      case CommandType::BIND_PROGRAM    : cc.wanted[STATE_PROGRAM    ] = command.data.bindProgramCommand.id    ; break;
+      case CommandType::BIND_VERTEXARRAY: cc.wanted[STATE_VERTEXARRAY] = command.data.bindVertexArrayCommand.id; break;
+      case CommandType::SUB_COMMAND:
+        if(command.data.subCommand.commandBuffer)
+          compileCommands(cc, *command.data.subCommand.commandBuffer);
+        break;
+      default:
+        compileExtension(cc, command);
+        break;
+    }
+  }
+}
+
+void izg_compile(CompiledCommandBuffer& compiled, CommandBuffer const& cb){
+  compiled.commands.clear();
+  compiled.records.clear();
+  compiled.cullNodes.clear();
+  CommandCompiler cc{compiled.commands, compiled.records, compiled.cullNodes};
+  compileCommands(cc, cb);
+
+  // Stav po izg_enqueue musi odpovidat poslednim prikazum, i kdyz uz se nekreslilo
+  for (uint32_t state = 0; state < NOF_COMMAND_STATES; ++state)
+    emitState(cc, (CommandState) state);
+}
+
+/// Provedeni zkompilovaneho command bufferu (volajici vlakno, nebo vlakno vykreslovani)
+void execute(GPUMemory& mem, CompiledCommandBuffer const& compiled, ExecutionSettings const& settings){
+  executed = &settings;
+
+  //Vynulovani pri kazdem volani funkce enqueue
+  mem.gl_DrawID = 0;
+
+  // Aplikace mohla mezi volanimi do hloubky zapisovat, hierarchicka hloubka plati az od dalsiho CLEAR
+  for (auto& hz : hiZ)
+    hz.depth = nullptr;
+
+  // Stejne tak mohla zmenit VertexArray, buffery nebo Program, plany se sestavi znovu
+  fetchPlan.vertexArray = -1;
+  varyingPlan.program = -1;
+
+  for(Command const& command : compiled.commands){
+    CommandData const& data = command.data;
+    switch(command.type){
+      case CommandType::CLEAR           : clear(mem, data.clearCommand); break;
+      case CommandType::DRAW            : draw(mem, data.drawCommand); break;
+      case CommandType::SET_DRAW_ID     : mem.gl_DrawID = data.setDrawIdCommand.id; break;
+      case CommandType::BIND_FRAMEBUFFER: mem.activatedFramebuffer = data.bindFramebufferCommand.id; break;
+      case CommandType::BIND_PROGRAM    : bindProgram(mem, data.bindProgramCommand.id); break;
+      case CommandType::BIND_VERTEXARRAY: bindVertexArray(mem, data.bindVertexArrayCommand.id); break;
+      default:
+        if(command.type == DRAW_INSTANCED)
+          drawInstanced(mem, commandData<DrawInstancedCommand>(command));
+        if(command.type == MULTI_DRAW){
+          multiDraw(mem, compiled, commandData<CompiledMultiDraw>(command));
+        }
+        if(command.type == CLEAR_TARGETS)
+          clearTargets(mem, commandData<ClearTargetsCommand>(command));
+        break;
+    }
+  }
+
+  // Dokresleni vsech dlazdic pred navratem z enqueue
+  flush(mem);
+
+  // Aplikace cte framebuffery primo z pameti, odlozena cisteni se musi vyplnit
+  for (uint32_t id = 0; id < nofFramebuffers; ++id)
+    resolveClears(mem, id);
+}
+
+/// Pricteni pocitadel (vynuluji se)
+void addStatistics(GPUStatistics& dst, GPUStatistics& src){
+  dst.vertexShaderInvocations += src.vertexShaderInvocations;
+  dst.vertexCacheHits         += src.vertexCacheHits;
+  dst.primitivesRejected      += src.primitivesRejected;
+  dst.primitivesClipped       += src.primitivesClipped;
+  dst.instancesCulled         += src.instancesCulled;
+  dst.deferredFallbacks       += src.deferredFallbacks;
+  src = GPUStatistics();
+}
+
+/// Vazby a gl_DrawID, ktere command buffer predava nasledujicimu
+struct Bindings{
+  uint32_t framebuffer = 0;
+  uint32_t program     = 0;
+  uint32_t vertexArray = 0;
+  uint32_t drawID      = 0;
+};
+
+Bindings bindingsOf(GPUMemory const& mem){
+  return Bindings{mem.activatedFramebuffer, mem.activatedProgram, mem.activatedVertexArray, mem.gl_DrawID};
+}
+
+void setBindings(GPUMemory& mem, Bindings const& bindings){
+  mem.activatedFramebuffer = bindings.framebuffer;
+  mem.activatedProgram     = bindings.program;
+  mem.activatedVertexArray = bindings.vertexArray;
+  mem.gl_DrawID            = bindings.drawID;
+}
+
+/// Odeslany command buffer cekajici na vlakno vykreslovani, s kopii pameti a nastaveni z okamziku odeslani
+struct Submission{
+  std::unique_ptr<GPUMemory> mem;
+  ExecutionSettings          settings;
+  CompiledCommandBuffer      compiled;
+  bool                       carryBindings = false; // vazby z predchoziho odeslani (aplikace je jeste nema)
+};
+
+/// Kruhova fronta odeslanych command bufferu, fence = poradove cislo odeslani (od 1)
+struct SubmitQueue{
+  ~SubmitQueue();
+
+  std::thread             thread;
+  std::mutex              mutex;
+  std::condition_variable submitted, completed;
+  Submission              ring[submitRingSize];
+  uint64_t                head = 0;   // pocet odeslanych
+  uint64_t                tail = 0;   // pocet dokoncenych
+  bool                    quit = false;
+  GPUMemory*              target = nullptr; // pamet aplikace poslednich odeslani
+  GPUStatistics           statistics;       // pocitadla dokoncenych odeslani, ktera aplikace jeste neprevzala
+  Bindings                bindings;         // vazby po poslednim dokoncenem odeslani
+  uint64_t                synced = 0;       // pocet odeslani, jejichz vazby uz jsou v pameti aplikace
+};
+
+SubmitQueue submitQueue;
+
+SubmitQueue::~SubmitQueue(){
+  if(!thread.joinable())
+    return;
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    quit = true;
+  }
+  submitted.notify_one();
+  thread.join();
+}
+
+/// Vlakno vykreslovani: zpracovava odeslane command buffery v poradi odeslani
+void renderLoop(){
+  SubmitQueue& q = submitQueue;
+  for(;;){
+    std::unique_lock<std::mutex> lock(q.mutex);
+    q.submitted.wait(lock, [&]{ return q.quit || q.head != q.tail; });
+    if(q.head == q.tail)
+      return;
+    Submission& submission = q.ring[q.tail % submitRingSize];
+    if(submission.carryBindings)
+      setBindings(*submission.mem, q.bindings);
+    lock.unlock();
+
+    execute(*submission.mem, submission.compiled, submission.settings);
+
+    lock.lock();
+    q.bindings = bindingsOf(*submission.mem);
+    addStatistics(q.statistics, executionStatistics);
+    ++q.tail;
+    q.completed.notify_all();
+  }
+}
+
+/// Volny slot fronty pro dalsi odeslani (ceka, az vlakno vykreslovani nejaky uvolni)
+Submission& reserveSubmission(GPUMemory& mem){
+  SubmitQueue& q = submitQueue;
+
+  // Vazby odeslani do jine pameti se musi zapsat do jeji aplikace driv, nez se prepne
+  if(q.target != &mem)
+    izg_finish();
+
+  std::unique_lock<std::mutex> lock(q.mutex);
+  if(!q.thread.joinable())
+    q.thread = std::thread(renderLoop);
+  q.completed.wait(lock, [&]{ return q.head - q.tail < submitRingSize; });
+  q.target = &mem;
+
+  // Slot uz vlakno vykreslovani necte, muze se plnit bez zamku
+  Submission& submission = q.ring[q.head % submitRingSize];
+  submission.carryBindings = q.synced != q.head;
+  lock.unlock();
+
+  if(!submission.mem)
+    submission.mem = std::make_unique<GPUMemory>();
+  return submission;
+}
+
+/// Uniformy a VertexArray, ktere ctou prikazy odeslani
+struct SubmissionReads{
+  uint32_t          uniforms        = 0    ; // ctou se uniformy 0..uniforms-1
+  bool              allVertexArrays = false; // kresli se s VertexArray z predchoziho odeslani
+  std::vector<bool> vertexArrays;
+};
+
+/// Kresleni programem (-1 = neznamy), instance ctou uniformy gl_DrawID + izg_instanceID
+void readsOfDraw(SubmissionReads& reads, ExecutionSettings const& settings, int64_t program, int64_t vertexArray,
+                 uint32_t firstDrawID, uint32_t nofDrawIDs){
+  uint64_t end = maxUniforms;
+  if(program >= 0 && program < nofPrograms){
+    ProgramSettings const& ps = settings.programs[program];
+    end = ps.nofUniforms + (uint64_t) (firstDrawID + nofDrawIDs) * ps.uniformsPerDraw;
+  }
+  reads.uniforms = (uint32_t) MAX((uint64_t) reads.uniforms, MIN(end, (uint64_t) maxUniforms));
+  if(vertexArray < 0 || vertexArray >= (int64_t) reads.vertexArrays.size())
+    reads.allVertexArrays = true;
+  else
+    reads.vertexArrays[vertexArray] = true;
+}
+
+/// Pruchod zkompilovanymi prikazy se stavem, jaky budou mit pri provadeni (vazby z predchoziho odeslani jsou nezname)
+void submissionReads(SubmissionReads& reads, CompiledCommandBuffer const& compiled, ExecutionSettings const& settings){
+  reads.uniforms = 0;
+  reads.allVertexArrays = false;
+  reads.vertexArrays.assign(sizeof(GPUMemory::vertexArrays) / sizeof(VertexArray), false);
+
+  int64_t  program = -1, vertexArray = -1;
+  uint32_t drawID = 0;
+  for(Command const& command : compiled.commands){
+    CommandData const& data = command.data;
+    switch(command.type){
+      case CommandType::DRAW            : readsOfDraw(reads, settings, program, vertexArray, drawID++, 1); break;
+      case CommandType::SET_DRAW_ID     : drawID = data.setDrawIdCommand.id; break;
+      case CommandType::BIND_PROGRAM    : program = data.bindProgramCommand.id; break;
+      case CommandType::BIND_VERTEXARRAY: vertexArray = data.bindVertexArrayCommand.id; break;
+      default:
+        if(command.type == DRAW_INSTANCED)
+          readsOfDraw(reads, settings, program, vertexArray, drawID++, commandData<DrawInstancedCommand>(command).nofInstances);
+        if(command.type == MULTI_DRAW){
+          CompiledMultiDraw const& multi = commandData<CompiledMultiDraw>(command);
+          if(multi.cullUniform >= 0)
+            reads.uniforms = MAX(reads.uniforms, MIN((uint32_t) multi.cullUniform + 1, maxUniforms));
+          for (uint32_t r = 0; r < multi.nofRecords; ++r){
+            DrawRecord const& record = compiled.records[multi.first + r];
+            vertexArray = record.vertexArray;
+            readsOfDraw(reads, settings, program, vertexArray, record.drawID, record.nofInstances);
+            drawID = record.drawID + 1;
+          }
+        }
+        break;
+    }
+  }
+}
+
+/// Kopie pameti a nastaveni do odeslani, z uniform a VertexArray jen ctene
+GPUFence commitSubmission(Submission& submission, GPUMemory const& mem){
+  static SubmissionReads reads;
+  submission.settings = executionSettings;
+  submissionReads(reads, submission.compiled, submission.settings);
+
+  GPUMemory& dst = *submission.mem;
+  std::copy(std::begin(mem.buffers), std::end(mem.buffers), dst.buffers);
+  std::copy(std::begin(mem.textures), std::end(mem.textures), dst.textures);
+  std::copy(mem.uniforms, mem.uniforms + reads.uniforms, dst.uniforms);
+  std::copy(std::begin(mem.programs), std::end(mem.programs), dst.programs);
+  std::copy(std::begin(mem.framebuffers), std::end(mem.framebuffers), dst.framebuffers);
+  for (uint32_t v = 0; v < reads.vertexArrays.size(); ++v)
+    if(reads.allVertexArrays || reads.vertexArrays[v])
+      dst.vertexArrays[v] = mem.vertexArrays[v];
+  setBindings(dst, bindingsOf(mem));
+
+  SubmitQueue& q = submitQueue;
+  GPUFence fence;
+  {
+    std::lock_guard<std::mutex> lock(q.mutex);
+    fence = ++q.head;
+  }
+  q.submitted.notify_one();
+  return fence;
+}
+
+GPUFence izg_submit(GPUMemory& mem, CommandBuffer const& cb){
+  Submission& submission = reserveSubmission(mem);
+  izg_compile(submission.compiled, cb);
+  return commitSubmission(submission, mem);
+}
+
+GPUFence izg_submit(GPUMemory& mem, CompiledCommandBuffer const& compiled){
+  Submission& submission = reserveSubmission(mem);
+  submission.compiled = compiled;
+  return commitSubmission(submission, mem);
+}
+
+GPUStatistics& izg_statistics(){
+  // Pocitadla odeslani se prevezmou pod zamkem fronty, vlakno vykreslovani globalni statistiky nezapisuje
+  std::lock_guard<std::mutex> lock(submitQueue.mutex);
+  addStatistics(gpuStatistics, submitQueue.statistics);
+  return gpuStatistics;
+}
+
+bool izg_poll(GPUFence fence){
+  std::lock_guard<std::mutex> lock(submitQueue.mutex);
+  return submitQueue.tail >= fence;
+}
+
+void izg_wait(GPUFence fence){
+  std::unique_lock<std::mutex> lock(submitQueue.mutex);
+  submitQueue.completed.wait(lock, [&]{ return submitQueue.tail >= fence; });
+}
+
+/// Pamet textury nahrazena v izg_uploadTexture, kterou mohou cist command buffery odeslane pred nahranim
+struct RetiredStorage{
+  GPUFence                         fence;
+  std::unique_ptr<UploadedTexture> storage;
+};
+
+std::vector<RetiredStorage> retiredStorage;
+
+/// Uvolneni pameti az po signalizaci fence vsech odeslani, ktera ji mohou cist
+void retireStorage(std::unique_ptr<UploadedTexture>&& storage){
+  SubmitQueue& q = submitQueue;
+  GPUFence head, tail;
+  {
+    std::lock_guard<std::mutex> lock(q.mutex);
+    head = q.head;
+    tail = q.tail;
+  }
+  retiredStorage.erase(std::remove_if(retiredStorage.begin(), retiredStorage.end(),
+                                      [&](RetiredStorage const& r){ return r.fence <= tail; }), retiredStorage.end());
+  if(head > tail && storage)
+    retiredStorage.push_back(RetiredStorage{head, std::move(storage)});
+}
+
+void izg_finish(){
+  SubmitQueue& q = submitQueue;
+  std::unique_lock<std::mutex> lock(q.mutex);
+  q.completed.wait(lock, [&]{ return q.tail == q.head; });
+
+  // Aplikace po izg_finish vidi vazby posledniho odeslani, jako po izg_enqueue
+  if(q.synced != q.head){
+    setBindings(*q.target, q.bindings);
+    q.synced = q.head;
+  }
+  lock.unlock();
+  retiredStorage.clear();
+  retiredTargets.clear();
+}
+
+void izg_enqueue(GPUMemory& mem, CompiledCommandBuffer const& compiled){
+  // Synchronni provadeni az po vsech odeslanych command bufferech
+  izg_finish();
+  execute(mem, compiled, executionSettings);
+  addStatistics(gpuStatistics, executionStatistics);
+}
+
+CompiledCommandBuffer enqueued;
+
+//! [izg_enqueue]
+void izg_enqueue(GPUMemory&mem,CommandBuffer const&cb){
+  /// \todo Tato funkce reprezentuje funkcionalitu grafické karty.<br>
+  /// Měla by umět zpracovat command buffer, čistit framebuffer a kreslit.<br>
+  /// mem obsahuje paměť grafické karty.
+  /// cb obsahuje command buffer pro zpracování.
+  /// Bližší informace jsou uvedeny na hlavní stránce dokumentace.
+
+  // Command buffer se zkompiluje (pamet prikazu se pouziva opakovane) a provede po odeslanych
+  izg_finish();
+  izg_compile(enqueued, cb);
+  execute(mem, enqueued, executionSettings);
+  addStatistics(gpuStatistics, executionStatistics);
+}
+//! [izg_enqueue]
+
+void izg_derivatives(uint32_t attribute, glm::vec4 const& fragCoord, glm::vec4& dFdx, glm::vec4& dFdy){
+  // Shader volany mimo rasterizaci nema sousedni pixely
+  if(shadedPrimitive == nullptr || shadedSetup == nullptr){
+    dFdx = dFdy = glm::vec4(0.f);
+    return;
+  }
+
+  Primitive const& primitive = *shadedPrimitive;
+  TriangleSetup const& setup = *shadedSetup;
+
+  // Barycentricke souradnice a jejich prirustky o pixel, vahy q_i = lambda_i / w_i
+  double px = (double) fragCoord.x * subpixelOne, py = (double) fragCoord.y * subpixelOne;
+  float q[3], qx[3], qy[3], sum = 0.f, sumX = 0.f, sumY = 0.f;
+  for (uint32_t i = 0; i < 3; ++i){
+    EdgeFunction const& e = setup.edge[i];
+    q[i]  = (float) (e.a * px + e.b * py + (double) (e.c + e.bias)) * setup.invArea2 * setup.invW[i];
+    qx[i] = (float) (e.a * subpixelOne) * setup.invArea2 * setup.invW[i];
+    qy[i] = (float) (e.b * subpixelOne) * setup.invArea2 * setup.invW[i];
+    sum  += q[i];
+    sumX += qx[i];
+    sumY += qy[i];
+  }
+
+  // A = sum(a_i q_i) / sum(q_i) --> dA = (sum(a_i dq_i) - A sum(dq_i)) / sum(q_i)
+  for (uint32_t c = 0; c < 4; ++c){
+    float a[3];
+    for (uint32_t i = 0; i < 3; ++i)
+      a[i] = ((float const*) &primitive.vertex[i].attributes[attribute])[c];
+    float value = (a[0]*q[0] + a[1]*q[1] + a[2]*q[2]) / sum;
+    dFdx[c] = (a[0]*qx[0] + a[1]*qx[1] + a[2]*qx[2] - value * sumX) / sum;
+    dFdy[c] = (a[0]*qy[0] + a[1]*qy[1] + a[2]*qy[2] - value * sumY) / sum;
+  }
+}
+
+/// Posledni dotazy vlakna do registru textur
+struct TextureLookup{
+  void const*           data    = nullptr;
+  TextureStorage const* storage = nullptr;
+  uint64_t              version = 0;
+};
+
+uint32_t const textureLookupSize = 8; // mocnina 2
+thread_local TextureLookup textureLookups[textureLookupSize];
+
+/// Popis nahrane textury, nullptr pro texturu v puvodnim (radkovem) formatu
+inline TextureStorage const* textureStorageOf(Image const& img){
+  if(img.data == nullptr)
+    return nullptr;
+
+  // Verze se cte pred dotazem, zmena registru behem nej jen vynuti dalsi dotaz
+  uint64_t version = textureRegistry.version.load(std::memory_order_acquire);
+  TextureLookup& cached = textureLookups[((uintptr_t) img.data >> 6) & (textureLookupSize - 1)];
+  if(cached.data == img.data && cached.version == version)
+    return cached.storage;
+
+  std::shared_lock<std::shared_mutex> lock(textureRegistry.mutex);
+  auto it = textureRegistry.textures.find(img.data);
+  cached.data    = img.data;
+  cached.storage = it != textureRegistry.textures.end() ? it->second : nullptr;
+  cached.version = version;
+  return cached.storage;
+}
+
+/// Index texelu [x,y] urovne: dlazdice po radcich, uvnitr dlazdice prolozene bity x a y
+inline uint64_t texelIndex(TextureLevel const& level, uint32_t x, uint32_t y){
+  static uint32_t const spread[8] = {0, 1, 4, 5, 16, 17, 20, 21};
+  uint32_t const mask = (1 << textureTileBits) - 1;
+  uint64_t tile = (uint64_t) (y >> textureTileBits) * level.tilesX + (x >> textureTileBits);
+  return level.offset + (tile << (2 * textureTileBits) | spread[y & mask] << 1 | spread[x & mask]);
+}
+
+inline glm::vec4 unpackTexel(TexelRGBA32F const& texel){
+  return texel;
+}
+
+inline glm::vec4 unpackTexel(TexelRGBA8 texel){
+  return glm::vec4(texel & 255, (texel >> 8) & 255, (texel >> 16) & 255, texel >> 24) / 255.f;
+}
+
+inline TexelRGBA8 packTexel(glm::vec4 const& color){
+  glm::vec4 c = glm::clamp(color, 0.f, 1.f) * 255.f + 0.5f;
+  return (TexelRGBA8) c.r | (TexelRGBA8) c.g << 8 | (TexelRGBA8) c.b << 16 | (TexelRGBA8) c.a << 24;
+}
+
+/// Texel [x,y] urovne v kanonickem formatu Texel - jedno cteni bez prevodu kanalu
+template<typename Texel>
+inline glm::vec4 levelTexel(Image const& img, TextureLevel const& level, uint32_t x, uint32_t y){
+  return unpackTexel(((Texel const*) img.data)[texelIndex(level, x, y)]);
+}
+
+/// RGB565 --> RGBA8 (nepruhledna)
+inline TexelRGBA8 expand565(uint16_t c){
+  uint32_t r = (c >> 11) & 31, g = (c >> 5) & 63, b = c & 31;
+  return (r << 3 | r >> 2) | (g << 2 | g >> 4) << 8 | (b << 3 | b >> 2) << 16 | 255u << 24;
+}
+
+/// Barva 0..255 --> RGB565
+inline uint16_t quantize565(float r, float g, float b){
+  return (uint16_t) ((uint32_t) (r * 31.f / 255.f + 0.5f) << 11 | (uint32_t) (g * 63.f / 255.f + 0.5f) << 5 | (uint32_t) (b * 31.f / 255.f + 0.5f));
+}
+
+/// Paleta barevneho bloku: 4 barvy, nebo 3 barvy + pruhledna cerna
+void colorPalette(uint16_t c0, uint16_t c1, bool fourColors, TexelRGBA8* palette){
+  palette[0] = expand565(c0);
+  palette[1] = expand565(c1);
+  palette[2] = 255u << 24;
+  palette[3] = fourColors ? 255u << 24 : 0;
+  for (uint32_t shift = 0; shift < 24; shift += 8){
+    uint32_t a = (palette[0] >> shift) & 255, b = (palette[1] >> shift) & 255;
+    palette[2] |= (fourColors ? (2 * a + b) / 3 : (a + b) / 2) << shift;
+    if(fourColors)
+      palette[3] |= ((a + 2 * b) / 3) << shift;
+  }
+}
+
+/// Paleta alfa bloku: 8 hodnot, nebo 6 hodnot + 0 a 255
+void alphaPalette(uint32_t a0, uint32_t a1, uint32_t* palette){
+  palette[0] = a0;
+  palette[1] = a1;
+  for (uint32_t i = 2; i < 8; ++i)
+    palette[i] = a0 > a1 ? ((8 - i) * a0 + (i - 1) * a1) / 7 : i < 6 ? ((6 - i) * a0 + (i - 1) * a1) / 5 : (i == 6 ? 0 : 255);
+}
+
+void decodeColors(uint8_t const* in, bool fourColors, TexelRGBA8* texels){
+  uint16_t c0, c1;
+  uint32_t indices;
+  std::memcpy(&c0, in, 2);
+  std::memcpy(&c1, in + 2, 2);
+  std::memcpy(&indices, in + 4, 4);
+
+  TexelRGBA8 palette[4];
+  colorPalette(c0, c1, fourColors || c0 > c1, palette);
+  for (uint32_t i = 0; i < 16; ++i)
+    texels[i] = palette[(indices >> (2 * i)) & 3];
+}
+
+void decodeAlpha(uint8_t const* in, TexelRGBA8* texels){
+  uint64_t indices = 0;
+  std::memcpy(&indices, in + 2, 6);
+
+  uint32_t palette[8];
+  alphaPalette(in[0], in[1], palette);
+  for (uint32_t i = 0; i < 16; ++i)
+    texels[i] = (texels[i] & 0xffffff) | palette[(indices >> (3 * i)) & 7] << 24;
+}
+
+inline void decodeBlock(TexelBC1 const& block, TexelRGBA8* texels){
+  decodeColors(block.color, false, texels);
+}
+
+inline void decodeBlock(TexelBC3 const& block, TexelRGBA8* texels){
+  decodeColors(block.color, true, texels);
+  decodeAlpha(block.alpha, texels);
+}
+
+/// Komprese barev bloku: koncove barvy na hlavni ose rozptylu barev, kazdy texel nejblizsi barva palety
+void encodeColors(TexelRGBA8 const* texels, uint8_t* out){
+  float c[16][3], mean[3] = {0.f, 0.f, 0.f}, lo[3] = {255.f, 255.f, 255.f}, hi[3] = {0.f, 0.f, 0.f};
+  for (uint32_t i = 0; i < 16; ++i)
+    for (uint32_t k = 0; k < 3; ++k){
+      c[i][k] = (float) ((texels[i] >> (8 * k)) & 255);
+      mean[k] += c[i][k] / 16.f;
+      lo[k] = MIN(lo[k], c[i][k]);
+      hi[k] = MAX(hi[k], c[i][k]);
+    }
+
+  float cov[3][3] = {};
+  for (uint32_t i = 0; i < 16; ++i)
+    for (uint32_t j = 0; j < 3; ++j)
+      for (uint32_t k = 0; k < 3; ++k)
+        cov[j][k] += (c[i][j] - mean[j]) * (c[i][k] - mean[k]);
+
+  // Mocninna metoda z uhlopricky boundary boxu
+  float axis[3] = {hi[0] - lo[0], hi[1] - lo[1], hi[2] - lo[2]};
+  for (uint32_t it = 0; it < 4; ++it){
+    float next[3], len = 0.f;
+    for (uint32_t j = 0; j < 3; ++j){
+      next[j] = cov[j][0] * axis[0] + cov[j][1] * axis[1] + cov[j][2] * axis[2];
+      len = MAX(len, std::fabs(next[j]));
+    }
+    if(len == 0.f)
+      break;
+    for (uint32_t j = 0; j < 3; ++j)
+      axis[j] = next[j] / len;
+  }
+
+  float tmin = 0.f, tmax = 0.f;
+  for (uint32_t i = 0; i < 16; ++i){
+    float t = (c[i][0] - mean[0]) * axis[0] + (c[i][1] - mean[1]) * axis[1] + (c[i][2] - mean[2]) * axis[2];
+    tmin = MIN(tmin, t);
+    tmax = MAX(tmax, t);
+  }
+
+  float norm = axis[0] * axis[0] + axis[1] * axis[1] + axis[2] * axis[2];
+  float e[2][3];
+  for (uint32_t k = 0; k < 3; ++k){
+    float dir = norm > 0.f ? axis[k] / norm : 0.f;
+    e[0][k] = glm::clamp(mean[k] + dir * tmax, 0.f, 255.f);
+    e[1][k] = glm::clamp(mean[k] + dir * tmin, 0.f, 255.f);
+  }
+
+  // c0 > c1 --> 4 barvy
+  uint16_t c0 = quantize565(e[0][0], e[0][1], e[0][2]), c1 = quantize565(e[1][0], e[1][1], e[1][2]);
+  if(c0 < c1)
+    std::swap(c0, c1);
+
+  TexelRGBA8 palette[4];
+  colorPalette(c0, c1, true, palette);
+
+  uint32_t indices = 0;
+  for (uint32_t i = 0; i < 16 && c0 != c1; ++i){
+    uint32_t best = 0, bestError = ~0u;
+    for (uint32_t p = 0; p < 4; ++p){
+      uint32_t error = 0;
+      for (uint32_t k = 0; k < 3; ++k){
+        int32_t d = (int32_t) ((palette[p] >> (8 * k)) & 255) - (int32_t) c[i][k];
+        error += d * d;
+      }
+      if(error < bestError){
+        best = p;
+        bestError = error;
+      }
+    }
+    indices |= best << (2 * i);
+  }
+
+  std::memcpy(out, &c0, 2);
+  std::memcpy(out + 2, &c1, 2);
+  std::memcpy(out + 4, &indices, 4);
+}
+
+/// Komprese alfy bloku: krajni hodnoty jako koncove body, 8 urovni
+void encodeAlpha(TexelRGBA8 const* texels, uint8_t* out){
+  uint32_t a0 = 0, a1 = 255;
+  for (uint32_t i = 0; i < 16; ++i){
+    a0 = MAX(a0, texels[i] >> 24);
+    a1 = MIN(a1, texels[i] >> 24);
+  }
+
+  uint32_t palette[8];
+  alphaPalette(a0, a1, palette);
+
+  uint64_t indices = 0;
+  for (uint32_t i = 0; i < 16 && a0 != a1; ++i){
+    uint32_t best = 0, bestError = ~0u;
+    for (uint32_t p = 0; p < 8; ++p){
+      uint32_t error = (uint32_t) std::abs((int32_t) palette[p] - (int32_t) (texels[i] >> 24));
+      if(error < bestError){
+        best = p;
+        bestError = error;
+      }
+    }
+    indices |= (uint64_t) best << (3 * i);
+  }
+
+  out[0] = (uint8_t) a0;
+  out[1] = (uint8_t) a1;
+  std::memcpy(out + 2, &indices, 6);
+}
+
+inline void encodeBlock(TexelRGBA8 const* texels, TexelBC1& block){
+  encodeColors(texels, block.color);
+}
+
+inline void encodeBlock(TexelRGBA8 const* texels, TexelBC3& block){
+  encodeColors(texels, block.color);
+  encodeAlpha(texels, block.alpha);
+}
+
+thread_local DecodedBlock blockCache[blockCacheSize];
+
+/// Texel komprimovane textury: blok se dekomprimuje cely a zustane v cache vlakna
+template<typename Block>
+inline glm::vec4 blockTexel(Image const& img, TextureLevel const& level, uint32_t x, uint32_t y){
+  uint64_t index = texelIndex(level, x, y);
+  Block const* block = (Block const*) img.data + (index >> 4);
+  uint64_t upload = textureStorageOf(img)->upload;
+
+  DecodedBlock& cached = blockCache[(index >> 4) & (blockCacheSize - 1)];
+  if(cached.block != block || cached.upload != upload){
+    decodeBlock(*block, cached.texels);
+    cached.block = block;
+    cached.upload = upload;
+  }
+  return unpackTexel(cached.texels[index & 15]);
+}
+
+template<>
+inline glm::vec4 levelTexel<TexelBC1>(Image const& img, TextureLevel const& level, uint32_t x, uint32_t y){
+  return blockTexel<TexelBC1>(img, level, x, y);
+}
+
+template<>
+inline glm::vec4 levelTexel<TexelBC3>(Image const& img, TextureLevel const& level, uint32_t x, uint32_t y){
+  return blockTexel<TexelBC3>(img, level, x, y);
+}
+
+/// Texel urovne nahrane textury v libovolnem formatu
+glm::vec4 storageTexel(Image const& img, TextureStorage const& ts, uint32_t level, uint32_t x, uint32_t y){
+  switch(ts.format){
+    case TexelFormat::RGBA8  : return levelTexel<TexelRGBA8  >(img, ts.levels[level], x, y);
+    case TexelFormat::RGBA32F: return levelTexel<TexelRGBA32F>(img, ts.levels[level], x, y);
+    case TexelFormat::BC1    : return levelTexel<TexelBC1    >(img, ts.levels[level], x, y);
+    case TexelFormat::BC3    : return levelTexel<TexelBC3    >(img, ts.levels[level], x, y);
+  }
+  return glm::vec4(0.f);
+}
+
+/// Pocet texelu urovne vcetne doplneni na cele dlazdice
+inline uint64_t levelTexels(TextureLevel const& level){
+  uint32_t tilesY = (level.height + (1 << textureTileBits) - 1) >> textureTileBits;
+  return (uint64_t) level.tilesX * tilesY << (2 * textureTileBits);
+}
+
+/// Komprese bloku urovne (16 po sobe jdoucich texelu), texels obsahuje jen tuto uroven
+template<typename Block>
+void encodeBlocks(TexelRGBA8 const* texels, TextureLevel const& level, uint8_t* data){
+  uint64_t nofBlocks = levelTexels(level) / 16;
+  Block* blocks = (Block*) data + level.offset / 16;
+  for (uint64_t b = 0; b < nofBlocks; ++b)
+    encodeBlock(texels + 16 * b, blocks[b]);
+}
+
+inline TexelRGBA8 averageTexels(TexelRGBA8 a, TexelRGBA8 b, TexelRGBA8 c, TexelRGBA8 d){
+  TexelRGBA8 result = 0;
+  for (uint32_t shift = 0; shift < 32; shift += 8)
+    result |= (((a >> shift) & 255) + ((b >> shift) & 255) + ((c >> shift) & 255) + ((d >> shift) & 255) + 2) / 4 << shift;
+  return result;
+}
+
+inline TexelRGBA32F averageTexels(TexelRGBA32F const& a, TexelRGBA32F const& b, TexelRGBA32F const& c, TexelRGBA32F const& d){
+  return (a + b + c + d) * 0.25f;
+}
+
+inline void storeTexel(TexelRGBA8& texel, glm::vec4 const& color){
+  texel = packTexel(color);
+}
+
+inline void storeTexel(TexelRGBA32F& texel, glm::vec4 const& color){
+  texel = color;
+}
+
+/// Uroven 0 z puvodniho obrazu
+template<typename Texel>
+void fillLevel0(Texel* texels, TextureLevel const& level, Texture const& texture){
+  for (uint32_t y = 0; y < level.height; ++y)
+    for (uint32_t x = 0; x < level.width; ++x)
+      storeTexel(texels[texelIndex(level, x, y)], texelFetch(texture, glm::uvec2(x, y)));
+}
+
+/// Uroven prumerem 2x2 texelu predchozi urovne (licha velikost opakuje posledni radek/sloupec)
+template<typename Texel>
+void downsample(Texel const* src, TextureLevel const& srcLevel, Texel* dst, TextureLevel const& dstLevel){
+  for (uint32_t y = 0; y < dstLevel.height; ++y)
+    for (uint32_t x = 0; x < dstLevel.width; ++x){
+      uint32_t x0 = MIN(2 * x, srcLevel.width - 1), x1 = MIN(2 * x + 1, srcLevel.width - 1),
+               y0 = MIN(2 * y, srcLevel.height - 1), y1 = MIN(2 * y + 1, srcLevel.height - 1);
+      dst[texelIndex(dstLevel, x, y)] = averageTexels(src[texelIndex(srcLevel, x0, y0)], src[texelIndex(srcLevel, x1, y0)],
+                                                      src[texelIndex(srcLevel, x0, y1)], src[texelIndex(srcLevel, x1, y1)]);
+    }
+}
+
+/// Texely za okrajem urovne (doplneni na cele dlazdice) opakuji okraj, aby nekazily kompresi bloku
+template<typename Texel>
+void padLevel(Texel* texels, TextureLevel const& level){
+  uint32_t tileSize = 1 << textureTileBits;
+  uint32_t paddedHeight = (level.height + tileSize - 1) / tileSize * tileSize;
+  for (uint32_t y = 0; y < paddedHeight; ++y)
+    for (uint32_t x = (y < level.height ? level.width : 0); x < level.tilesX * tileSize; ++x)
+      texels[texelIndex(level, x, y)] = texels[texelIndex(level, MIN(x, level.width - 1), MIN(y, level.height - 1))];
+}
+
+/// Vsechny urovne primo v pameti textury, kazda z predchozi
+template<typename Texel>
+void buildLevels(Texel* texels, TextureStorage const& header, Texture const& texture){
+  fillLevel0(texels, header.levels[0], texture);
+  for (uint32_t l = 1; l < header.nofLevels; ++l)
+    downsample(texels, header.levels[l - 1], texels, header.levels[l]);
+  for (uint32_t l = 0; l < header.nofLevels; ++l)
+    padLevel(texels, header.levels[l]);
+}
+
+void izg_uploadTexture(GPUMemory& mem, uint32_t id, Texture const& texture, TextureFilter filter, bool compress){
+  Texture& dst = mem.textures[id];
+  dst = texture;
+  if(texture.img.data == nullptr || texture.width == 0 || texture.height == 0)
+    return;
+
+  // Velikosti urovni az po 1x1, kazda zarovnana na cele dlazdice (NEAREST cte jen uroven 0)
+  TextureStorage header;
+  header.upload = ++textureUploads;
+  header.filter = filter;
+  header.nofLevels = 0;
+  uint64_t nofTexels = 0;
+  for (uint32_t w = texture.width, h = texture.height;; w = MAX(1u, w / 2), h = MAX(1u, h / 2)){
+    TextureLevel& level = header.levels[header.nofLevels++];
+    level.width  = w;
+    level.height = h;
+    level.tilesX = (w + (1 << textureTileBits) - 1) >> textureTileBits;
+    level.offset = nofTexels;
+    nofTexels += levelTexels(level);
+    if((w == 1 && h == 1) || header.nofLevels == maxTextureLevels || filter == TextureFilter::NEAREST)
+      break;
+  }
+
+  // Pri kompresi se urovne staveji v RGBA8 po jedne (vzdy jen predchozi a aktualni), uroven 0 rozhodne o pruhlednosti
+  std::vector<TexelRGBA8> level, next;
+  bool compressed = compress && texture.img.format == Image::UINT8;
+  if(compressed){
+    TextureLevel local = header.levels[0];
+    local.offset = 0;
+    level.resize(levelTexels(local));
+    fillLevel0(level.data(), local, texture);
+    bool opaque = true;
+    for (uint32_t y = 0; y < local.height; ++y)
+      for (uint32_t x = 0; x < local.width; ++x)
+        opaque = opaque && (level[texelIndex(local, x, y)] >> 24) == 255;
+    header.format = opaque ? TexelFormat::BC1 : TexelFormat::BC3;
+  } else
+    header.format = texture.img.format == Image::UINT8 ? TexelFormat::RGBA8 : TexelFormat::RGBA32F;
+
+  size_t size = 0;
+  switch(header.format){
+    case TexelFormat::RGBA8  : size = nofTexels * sizeof(TexelRGBA8  ); break;
+    case TexelFormat::RGBA32F: size = nofTexels * sizeof(TexelRGBA32F); break;
+    case TexelFormat::BC1    : size = nofTexels / 16 * sizeof(TexelBC1); break;
+    case TexelFormat::BC3    : size = nofTexels / 16 * sizeof(TexelBC3); break;
+  }
+
+  // Zdrojem muze byt i drive nahrana textura, stara pamet se uvolni az na konci
+  auto storage = std::make_unique<UploadedTexture>(header, size);
+  uint8_t* data = storage->texels.data();
+
+  switch(header.format){
+    case TexelFormat::RGBA8  : buildLevels((TexelRGBA8  *) data, header, texture); break;
+    case TexelFormat::RGBA32F: buildLevels((TexelRGBA32F*) data, header, texture); break;
+    case TexelFormat::BC1    :
+    case TexelFormat::BC3    :
+      for (uint32_t l = 0; l < header.nofLevels; ++l){
+        TextureLevel local = header.levels[l];
+        local.offset = 0;
+        padLevel(level.data(), local);
+        if(header.format == TexelFormat::BC1)
+          encodeBlocks<TexelBC1>(level.data(), header.levels[l], data);
+        else
+          encodeBlocks<TexelBC3>(level.data(), header.levels[l], data);
+        if(l + 1 == header.nofLevels)
+          break;
+        TextureLevel nextLocal = header.levels[l + 1];
+        nextLocal.offset = 0;
+        next.assign(levelTexels(nextLocal), 0);
+        downsample(level.data(), local, next.data(), nextLocal);
+        level.swap(next);
+      }
+      break;
+  }
+
+  // Kazda pamet gpu vlastni sve textury, nahrani do jine pameti se stejnym id je neuvolni
+  std::vector<std::unique_ptr<UploadedTexture>>& slots = textureStorage[&mem];
+  if(slots.empty())
+    slots.resize(nofTextures);
+  slots[id].swap(storage);
+  retireStorage(std::move(storage));
+
+  dst.img.data          = data;
+  dst.img.format        = header.format == TexelFormat::RGBA32F ? Image::FLOAT32 : Image::UINT8;
+  dst.img.channels      = 4;
+  dst.img.bytesPerPixel = header.format == TexelFormat::RGBA32F ? sizeof(TexelRGBA32F) : sizeof(TexelRGBA8);
+  dst.img.pitch         = 0;
+}
+
+uint64_t izg_textureUpload(Texture const& texture){
+  TextureStorage const* ts = textureStorageOf(texture.img);
+  return ts ? ts->upload : 0;
+}
+
+void izg_releaseTextures(GPUMemory& mem){
+  auto it = textureStorage.find(&mem);
+  if(it == textureStorage.end())
+    return;
+
+  for (uint32_t id = 0; id < nofTextures; ++id){
+    std::unique_ptr<UploadedTexture>& storage = it->second[id];
+    if(!storage)
+      continue;
+    if(mem.textures[id].img.data == storage->texels.data())
+      mem.textures[id] = Texture();
+    retireStorage(std::move(storage));
+  }
+  textureStorage.erase(it);
+}
+
+/// Bilinearni interpolace 2x2 texelu urovne, textura se opakuje
+template<typename Texel>
+glm::vec4 sampleBilinear(Image const& img, TextureLevel const& level, glm::vec2 uv){
+  glm::vec2 st = uv * glm::vec2(level.width, level.height) - 0.5f;
+  glm::vec2 base = glm::floor(st);
+  glm::vec2 f = st - base;
+
+  auto wrap = [](float v, uint32_t size){
+    int64_t i = (int64_t) v % (int64_t) size;
+    return (uint32_t) (i < 0 ? i + size : i);
+  };
+  uint32_t x0 = wrap(base.x, level.width), x1 = x0 + 1 == level.width ? 0 : x0 + 1;
+  uint32_t y0 = wrap(base.y, level.height), y1 = y0 + 1 == level.height ? 0 : y0 + 1;
+
+  glm::vec4 top    = glm::mix(levelTexel<Texel>(img, level, x0, y0), levelTexel<Texel>(img, level, x1, y0), f.x);
+  glm::vec4 bottom = glm::mix(levelTexel<Texel>(img, level, x0, y1), levelTexel<Texel>(img, level, x1, y1), f.x);
+  return glm::mix(top, bottom, f.y);
+}
+
+/// Filtrovane cteni urovne lod textury s texely formatu Texel
+template<typename Texel>
+glm::vec4 sampleLod(Texture const& texture, TextureStorage const* ts, glm::vec2 uv, float lod){
+  float maxLevel = (float) (ts->nofLevels - 1);
+  lod = lod > 0.f ? MIN(lod, maxLevel) : 0.f;
+
+  if(ts->filter == TextureFilter::BILINEAR)
+    return sampleBilinear<Texel>(texture.img, ts->levels[(uint32_t) (lod + 0.5f)], uv);
+
+  // Trilinearni: mezi dvema sousednimi urovnemi
+  uint32_t l0 = (uint32_t) lod, l1 = MIN(l0 + 1, ts->nofLevels - 1);
+  glm::vec4 c0 = sampleBilinear<Texel>(texture.img, ts->levels[l0], uv);
+  if(l1 == l0)
+    return c0;
+  return glm::mix(c0, sampleBilinear<Texel>(texture.img, ts->levels[l1], uv), lod - (float) l0);
+}
+
+glm::vec4 read_textureLod(Texture const&texture,glm::vec2 uv,float lod){
+  TextureStorage const* ts = textureStorageOf(texture.img);
+  if(ts == nullptr || ts->filter == TextureFilter::NEAREST || !(uv.x == uv.x && uv.y == uv.y))
+    return read_texture(texture, uv);
+
+  switch(ts->format){
+    case TexelFormat::RGBA8  : return sampleLod<TexelRGBA8  >(texture, ts, uv, lod);
+    case TexelFormat::RGBA32F: return sampleLod<TexelRGBA32F>(texture, ts, uv, lod);
+    case TexelFormat::BC1    : return sampleLod<TexelBC1    >(texture, ts, uv, lod);
+    case TexelFormat::BC3    : return sampleLod<TexelBC3    >(texture, ts, uv, lod);
+  }
+  return glm::vec4(0.f);
+}
+
+bool izg_textureNeedsDerivatives(Texture const&texture){
+  TextureStorage const* ts = textureStorageOf(texture.img);
+  return ts != nullptr && ts->filter != TextureFilter::NEAREST && ts->nofLevels > 1;
+}
+
+glm::vec4 read_textureGrad(Texture const&texture,glm::vec2 uv,glm::vec2 dUVdx,glm::vec2 dUVdy){
+  TextureStorage const* ts = textureStorageOf(texture.img);
+  if(ts == nullptr || ts->filter == TextureFilter::NEAREST)
+    return read_texture(texture, uv);
+
+  // Uroven podle delsiho z obrazu pixelu v texelech
+  glm::vec2 size = glm::vec2(texture.width, texture.height);
+  float rho = MAX(glm::length(dUVdx * size), glm::length(dUVdy * size));
+  return read_textureLod(texture, uv, rho > 0.f ? std::log2(rho) : 0.f);
 }
-//! [izg_enqueue]
 
 /**
  * @brief This function reads color from texture.
@@ -440,6 +3266,8 @@ glm::vec4 texelFetch(Texture const&texture,glm::uvec2 pix){
   auto&img = texture.img;
   glm::vec4 color = glm::vec4(0.f,0.f,0.f,1.f);
   if(pix.x>=texture.width || pix.y >=texture.height)return color;
+  if(TextureStorage const* ts = textureStorageOf(img))
+    return storageTexel(img, *ts, 0, pix.x, pix.y);
   if(img.format == Image::UINT8){
     auto colorPtr = (uint8_t*)getPixel(img,pix.x,pix.y);
     for(uint32_t c=0;c<img.channels;++c)
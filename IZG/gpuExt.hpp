@@ -0,0 +1,435 @@
+/*!
+ * @file
+ * @brief This file contains extensions of gpu (rendering modes and settings)
+ */
+#pragma once
+
+#include <student/fwd.hpp>
+
+#include <cmath>
+#include <cstring>
+#include <vector>
+
+/**
+ * @brief Filtering of textures uploaded by izg_uploadTexture
+ */
+enum class TextureFilter : uint8_t{
+  NEAREST  , ///< nejblizsi texel urovne 0, stejne jako read_texture
+  BILINEAR , ///< bilinearni interpolace na nejblizsi mip urovni
+  TRILINEAR, ///< bilinearni interpolace na dvou mip urovnich a linearni mezi nimi
+};
+
+/**
+ * @brief Settings of the rasterization backend
+ */
+struct GPUSettings{
+  bool     binning       = true; ///< trojuhelniky se tridi do dlazdic a rasterizuji vice vlakny
+  uint32_t tileSize      = 32  ; ///< velikost dlazdice v pixelech (ctverec)
+  uint32_t nofThreads    = 0   ; ///< pocet vlaken rasterizace, 0 = std::thread::hardware_concurrency()
+  bool     simd          = true; ///< vyhodnoceni 8 pixelu najednou (AVX2), pokud to procesor umi
+  bool     hierarchicalZ = true; ///< odmitani zakrytych bloku 8x8 a trojuhelniku podle maxim hloubky
+  bool     vertexCache   = true; ///< indexovany DRAW pocita kazdy vrchol (gl_VertexID) jen jednou
+  bool     fastClear     = false; ///< CLEAR jen oznaci dlazdice, vyplni se az pri prvnim kresleni do nich nebo na konci izg_enqueue
+  TextureFilter textureFilter = TextureFilter::NEAREST; ///< filtrace textur nahravanych v prepareModel
+  bool     textureCompression = false; ///< textury nahravane v prepareModel se komprimuji (BC1/BC3)
+  bool     tileMemory    = false; ///< pri binningu se dlazdice rasterizuje v lokalni pameti vlakna (barva i hloubka v jednom bloku) a do framebufferu se zapise az po vsech trojuhelnicich
+  bool     deferredShading = false; ///< prepareModel kresli odlozenym stinovanim (G-buffer a jeden pruchod osvetleni pres obrazovku)
+  bool     multiDraw     = false; ///< prepareModel do draw listu volajiciho slozi vyskyty meshe do MULTI_DRAW (orezani podle kamery), jinak DRAW na uzel
+};
+
+/**
+ * @brief This function returns settings of the gpu
+ *
+ * @return reference to global settings, changes take effect with next izg_enqueue
+ */
+GPUSettings& izg_settings();
+
+/// Number of vertices or fragments processed by one invocation of a batched shader
+uint32_t const shaderBatchSize = 8;
+
+/**
+ * @brief Attribute of a batch in structure-of-arrays form, v[component][lane] (only floating point attributes)
+ */
+struct AttributeBatch{
+  alignas(32) float v[4][shaderBatchSize];
+};
+
+/**
+ * @brief Input of batched vertex shader, lanes >= count repeat the last valid vertex
+ */
+struct InVertexBatch{
+  AttributeBatch attributes[maxAttributes]; ///< atributy z VertexArray (jen aktivni)
+  uint32_t       gl_VertexID[shaderBatchSize];
+  uint32_t       count;                      ///< pocet platnych vrcholu
+};
+
+/**
+ * @brief Output of batched vertex shader, only attributes used by Program::vs2fs are read back
+ */
+struct OutVertexBatch{
+  AttributeBatch attributes[maxAttributes];
+  AttributeBatch gl_Position;
+};
+
+/**
+ * @brief Input of batched fragment shader, lanes >= count repeat the last valid fragment
+ */
+struct InFragmentBatch{
+  AttributeBatch attributes[maxAttributes]; ///< interpolovane atributy podle Program::vs2fs
+  AttributeBatch gl_FragCoord;
+  uint32_t       count;                      ///< pocet platnych fragmentu
+};
+
+/**
+ * @brief Output of batched fragment shader
+ */
+struct OutFragmentBatch{
+  AttributeBatch gl_FragColor;
+  bool           discard[shaderBatchSize];
+};
+
+using VertexShaderBatch   = void(*)(OutVertexBatch  &,InVertexBatch   const&,ShaderInterface const&);
+using FragmentShaderBatch = void(*)(OutFragmentBatch&,InFragmentBatch const&,ShaderInterface const&);
+
+/// Maximal size of per-draw constant block in bytes
+uint32_t const maxDrawConstants = 512;
+
+using DrawPrepare = void(*)(void*constants,ShaderInterface const&);
+
+/// Maximal number of render targets of a program
+uint32_t const maxRenderTargets = 4;
+
+/**
+ * @brief Settings of a program (indexed the same way as GPUMemory::programs)
+ *
+ * Render target is a texture slot owned by the gpu: every DRAW of the program writes FLOAT32 RGBA texture of the size
+ * of the bound framebuffer to mem.textures[id], its storage is reallocated (cleared to zero) when the size changes.
+ * It is addressed by rasterization coordinates (gl_FragCoord) without yReversed, so texelFetch(texture, uvec2(gl_FragCoord))
+ * reads the value written at the same pixel. CLEAR does not touch render targets, CLEAR_TARGETS clears those of the bound program.
+ * The slot must not hold another texture.
+ */
+struct ProgramSettings{
+  bool                earlyDepthTest      = true   ; ///< hloubkovy test pred interpolaci atributu a fragment shaderem, vypnout pro programy menici hloubku
+  VertexShaderBatch   vertexShaderBatch   = nullptr; ///< pokud je nastaven, pouzije se misto Program::vertexShader
+  FragmentShaderBatch fragmentShaderBatch = nullptr; ///< pokud je nastaven, pouzije se misto Program::fragmentShader
+  DrawPrepare         prepare             = nullptr; ///< vola se jednou pro kazdy DRAW, vyplni blok konstant (nejvyse maxDrawConstants bajtu)
+  bool                depthOnly           = false  ; ///< jen hloubka (stinova mapa, z-prepass): bez varyingu a fragment shaderu, tedy i bez discard
+  bool                colorWrite          = true   ; ///< zapis barvy do framebufferu (false: jen hloubka a render targety, napr. G-buffer)
+  bool                depthWrite          = true   ; ///< zapis hloubky po uspesnem testu (false: pruchod pres celou obrazovku nad ulozenou hloubkou)
+  int32_t             renderTargets[maxRenderTargets] = {-1,-1,-1,-1}; ///< textury, do kterych zapisuje izg_fragmentOutput, -1 = zadna
+  uint32_t            nofUniforms         = maxUniforms; ///< shadery ctou uniformy 0..nofUniforms-1 (izg_submit kopiruje jen ctene uniformy)
+  uint32_t            uniformsPerDraw     = 0      ; ///< a navic uniformy nofUniforms + (gl_DrawID+izg_instanceID)*uniformsPerDraw .. + uniformsPerDraw-1
+};
+
+/**
+ * @brief This function returns settings of a program
+ *
+ * @param programId index of program in GPUMemory::programs
+ *
+ * @return reference to program settings, they are read by every DRAW
+ */
+ProgramSettings& izg_programSettings(uint32_t programId);
+
+/**
+ * @brief Statistics of the gpu, accumulated over all izg_enqueue and izg_submit calls (can be reset by assignment)
+ */
+struct GPUStatistics{
+  uint64_t vertexShaderInvocations = 0; ///< pocet spusteni vertex shaderu
+  uint64_t vertexCacheHits         = 0; ///< pocet vrcholu prevzatych z post-transform cache
+  uint64_t primitivesRejected      = 0; ///< trojuhelniky cele mimo frustum (trivialni zamitnuti)
+  uint64_t primitivesClipped       = 0; ///< trojuhelniky orezane near rovinou nebo guard bandem
+  uint64_t instancesCulled         = 0; ///< instance MULTI_DRAW, jejichz box je cely mimo frustum
+  uint64_t deferredFallbacks       = 0; ///< prepareModel s GPUSettings::deferredShading, ktery kreslil dopredne (model pouziva rezervovane sloty)
+
+  /// Podil vrcholu, ktere nemusely byt znovu stinovany
+  float vertexCacheHitRate() const {
+    uint64_t total = vertexShaderInvocations + vertexCacheHits;
+    return total ? (float) vertexCacheHits / (float) total : 0.f;
+  }
+};
+
+/**
+ * @brief This function returns statistics of the gpu (call from the application thread)
+ *
+ * Counters of submitted command buffers are added by this call once their fences are signaled.
+ *
+ * @return reference to global statistics, the render thread does not write it
+ */
+GPUStatistics& izg_statistics();
+
+/**
+ * @brief This function returns constant block of the draw whose shader is running (call only from shaders)
+ *
+ * @return block filled by ProgramSettings::prepare, nullptr if the program has no prepare
+ */
+void const* izg_drawConstants();
+
+/**
+ * @brief This function returns constant block of the draw whose shader is running, only if it was filled by given prepare
+ *
+ * @param prepare function expected in ProgramSettings::prepare of the program
+ *
+ * @return block filled by prepare, nullptr if the program has no or another prepare
+ */
+void const* izg_drawConstants(DrawPrepare prepare);
+
+/**
+ * @brief This function returns gl_InstanceID of the vertex or fragment being shaded (call only from shaders or ProgramSettings::prepare)
+ *
+ * @return index of instance of DRAW_INSTANCED, 0 for DRAW
+ */
+uint32_t izg_instanceID();
+
+/**
+ * @brief This function writes additional output of the fragment being shaded to render target (call only from fragment shaders)
+ *
+ * The value is stored only if the fragment is not discarded and passes depth test.
+ *
+ * @param target index of render target (ProgramSettings::renderTargets)
+ * @param value value of the pixel
+ */
+void izg_fragmentOutput(uint32_t target,glm::vec4 const&value);
+
+/**
+ * @brief This function writes additional output of one lane of batched fragment shader (every active lane has to be written)
+ *
+ * @param target index of render target (ProgramSettings::renderTargets)
+ * @param lane lane of the batch
+ * @param value value of the pixel
+ */
+void izg_fragmentOutput(uint32_t target,uint32_t lane,glm::vec4 const&value);
+
+/**
+ * @brief This function computes screen-space derivatives of an interpolated attribute (call only from fragment shaders)
+ *
+ * Outside of rasterization (shader called directly) the derivatives are zero, i.e. level 0 is sampled.
+ *
+ * @param attribute index of attribute (Program::vs2fs)
+ * @param fragCoord gl_FragCoord of the fragment
+ * @param dFdx derivative of the attribute in x
+ * @param dFdy derivative of the attribute in y
+ */
+void izg_derivatives(uint32_t attribute,glm::vec4 const&fragCoord,glm::vec4&dFdx,glm::vec4&dFdy);
+
+/**
+ * @brief This function tests whether read_textureGrad of a texture depends on derivatives
+ *
+ * @param texture texture
+ *
+ * @return false if the texture is always sampled at level 0 (not uploaded, NEAREST filter or single level), izg_derivatives can be skipped
+ */
+bool izg_textureNeedsDerivatives(Texture const&texture);
+
+/**
+ * @brief This function uploads texture into gpu memory with mip chain in tiled layout
+ *
+ * The texture is converted into packed RGBA8 (UINT8 source) or RGBA32F texels in tiles of 8x8 texels (Morton order inside tile),
+ * mem.textures[id] then refers to memory owned by the gpu for mem until the next upload to the same id of mem or izg_releaseTextures.
+ * With compression UINT8 textures are stored in 4x4 blocks, BC1 (8 bytes, opaque textures) or BC3 (16 bytes).
+ *
+ * @param mem gpu memory
+ * @param id index of texture in GPUMemory::textures
+ * @param texture source texture
+ * @param filter filtering used by read_textureLod and read_textureGrad
+ * @param compress store UINT8 texture block compressed
+ */
+void izg_uploadTexture(GPUMemory&mem,uint32_t id,Texture const&texture,TextureFilter filter,bool compress);
+
+/**
+ * @brief This function returns serial number of the upload of texture
+ *
+ * @param texture texture
+ *
+ * @return number unique for every izg_uploadTexture, 0 if the texture was not uploaded
+ */
+uint64_t izg_textureUpload(Texture const&texture);
+
+/**
+ * @brief This function frees storage of all textures uploaded into memory (e.g. before the memory is destroyed)
+ *
+ * Textures of mem referring to the storage are reset, storage read by submitted command buffers is freed after their fences.
+ *
+ * @param mem gpu memory
+ */
+void izg_releaseTextures(GPUMemory&mem);
+
+/**
+ * @brief This function reads color from texture at given mip level (textures not uploaded by izg_uploadTexture are read by read_texture)
+ *
+ * @param texture texture
+ * @param uv uv coordinates
+ * @param lod mip level, 0 = full resolution
+ *
+ * @return color 4 floats
+ */
+glm::vec4 read_textureLod(Texture const&texture,glm::vec2 uv,float lod);
+
+/**
+ * @brief This function reads color from texture, mip level is selected from derivatives of uv coordinates
+ *
+ * @param texture texture
+ * @param uv uv coordinates
+ * @param dUVdx derivative of uv in x (izg_derivatives)
+ * @param dUVdy derivative of uv in y (izg_derivatives)
+ *
+ * @return color 4 floats
+ */
+glm::vec4 read_textureGrad(Texture const&texture,glm::vec2 uv,glm::vec2 dUVdx,glm::vec2 dUVdy);
+
+/// Draw nofInstances instances of DRAW (data DrawInstancedCommand), all instances see the same gl_DrawID
+constexpr CommandType DRAW_INSTANCED = static_cast<CommandType>(64);
+/// Draw array of records (data MultiDrawCommand), every record binds its vertex array and sets gl_DrawID
+constexpr CommandType MULTI_DRAW     = static_cast<CommandType>(65);
+/// Fill render targets of the bound program in the bound framebuffer (data ClearTargetsCommand)
+constexpr CommandType CLEAR_TARGETS  = static_cast<CommandType>(66);
+
+struct DrawInstancedCommand{
+  uint32_t nofVertices     = 0    ; ///< pocet vrcholu jedne instance
+  uint32_t nofInstances    = 1    ; ///< pocet instanci (izg_instanceID 0..nofInstances-1)
+  bool     backfaceCulling = false;
+};
+
+struct ClearTargetsCommand{
+  glm::vec4 value = glm::vec4(0.f); ///< hodnota vsech texelu render targetu
+};
+
+/**
+ * @brief One draw of MULTI_DRAW, after the record mem.activatedVertexArray = vertexArray and mem.gl_DrawID = drawID + 1
+ */
+struct DrawRecord{
+  uint32_t vertexArray     = 0    ; ///< VertexArray zaznamu
+  uint32_t nofVertices     = 0    ;
+  uint32_t nofInstances    = 1    ;
+  uint32_t drawID          = 0    ; ///< gl_DrawID vsech instanci zaznamu
+  bool     backfaceCulling = false;
+};
+
+/**
+ * @brief Axis aligned bounding box, empty if min > max, unbounded if not finite
+ */
+struct BoundingBox{
+  glm::vec3 min = glm::vec3(+INFINITY);
+  glm::vec3 max = glm::vec3(-INFINITY);
+};
+
+/**
+ * @brief Node of culling hierarchy of MULTI_DRAW, nodes are stored in depth-first pre-order
+ *
+ * Node 0 is the root of the whole hierarchy, its end is the number of nodes.
+ */
+struct CullNode{
+  BoundingBox bounds     ; ///< svetovy box celeho podstromu
+  BoundingBox objectBox  ; ///< svetovy box objektu uzlu
+  uint32_t    end    = 1 ; ///< index za poslednim uzlem podstromu
+  int32_t     object = -1; ///< objekt uzlu (drawID + instance), -1 = uzel bez objektu
+};
+
+/**
+ * @brief Records of MULTI_DRAW, optionally culled against view frustum when the command is executed
+ *
+ * With cullNodes and cullUniform >= 0 the hierarchy is tested against mem.uniforms[cullUniform].m4 (projection * view)
+ * valid at execution: a subtree completely outside culls all its objects, a subtree completely inside keeps them
+ * without further tests, otherwise the box of the node's object decides and the children are tested.
+ * Culled instances are not drawn, the remaining ones form runs with gl_DrawID = drawID + first instance of the run.
+ * Objects without a node are never culled.
+ */
+struct MultiDrawCommand{
+  DrawRecord const*  records     = nullptr; ///< pole zaznamu, kopiruje se pri kompilaci (izg_enqueue, izg_submit, izg_compile), pak se smi menit
+  uint32_t           nofRecords  = 0      ;
+  int32_t            cullUniform = -1     ; ///< uniforma s matici projView kamery, -1 = bez orezani
+  CullNode const*    cullNodes   = nullptr; ///< hierarchie boxu objektu (cullNodes[0].end uzlu), kopiruje se pri kompilaci
+};
+
+/**
+ * @brief This function appends command of the extension (DRAW_INSTANCED, MULTI_DRAW, CLEAR_TARGETS) to command buffer
+ *
+ * @param cb command buffer
+ * @param type type of command
+ * @param data data of command, stored bytewise in Command::data
+ */
+template<typename Data>
+inline void izg_pushCommand(CommandBuffer&cb,CommandType type,Data const&data){
+  static_assert(sizeof(Data) <= sizeof(CommandData),"command data does not fit into CommandData");
+  Command&command = cb.commands[cb.nofCommands++];
+  std::memcpy((void*)&command.data,&data,sizeof(Data));
+  command.type = type;
+}
+
+/**
+ * @brief Command buffer compiled by izg_compile
+ *
+ * Sub-commands are flattened, binds and SET_DRAW_ID are emitted only right before the CLEAR or DRAW
+ * that uses them and only if they change the state. Referenced command buffers and records of MULTI_DRAW are not read again.
+ */
+struct CompiledCommandBuffer{
+  std::vector<Command>     commands; ///< jen CLEAR, DRAW a skutecne zmeny stavu
+  std::vector<DrawRecord>  records ; ///< kopie zaznamu vsech MULTI_DRAW
+  std::vector<CullNode>    cullNodes; ///< kopie hierarchii orezavanych MULTI_DRAW
+};
+
+/**
+ * @brief This function compiles command buffer (including sub-commands) into compact command stream
+ *
+ * @param compiled output, previous content is replaced
+ * @param cb command buffer
+ */
+void izg_compile(CompiledCommandBuffer&compiled,CommandBuffer const&cb);
+
+/**
+ * @brief This function executes compiled command stream, it has the same effect as izg_enqueue of the source command buffer
+ *
+ * @param mem gpu memory
+ * @param compiled command stream from izg_compile
+ */
+void izg_enqueue(GPUMemory&mem,CompiledCommandBuffer const&compiled);
+
+/// Fence of a submitted command buffer (submission number), 0 is always signaled
+using GPUFence = uint64_t;
+
+/**
+ * @brief This function submits command buffer for asynchronous execution by the render thread
+ *
+ * Command buffers are executed in submission order; the command buffer (and its sub-commands, records of MULTI_DRAW)
+ * is compiled during the call and can be reused right after it. GPUMemory itself and program settings (izg_programSettings)
+ * are copied during the call too (of uniforms and vertex arrays only those read by the commands, uniforms according to
+ * ProgramSettings::nofUniforms and uniformsPerDraw of the drawing programs), so right after it the application may change uniforms, programs, vertex arrays,
+ * textures, framebuffer descriptions and program settings, or upload textures by izg_uploadTexture (replaced storage is freed
+ * after the fence) - e.g. prepareModel and new camera uniforms for the next frame while this one is drawn.
+ * Until the fence is signaled the application must not modify or free data pointed to by the copy (buffer data,
+ * images of textures not uploaded by izg_uploadTexture, framebuffer images), nor read framebuffers written by the commands.
+ * Binds and gl_DrawID of submitted commands pass to the next submission and are written to mem by izg_finish.
+ * Settings of the gpu (izg_settings) are not copied, they may be changed only after izg_finish.
+ * Blocks while submitRingSize submissions are in flight. Submit from one thread only.
+ *
+ * @param mem gpu memory
+ * @param cb command buffer
+ *
+ * @return fence signaled when the command buffer is executed
+ */
+GPUFence izg_submit(GPUMemory&mem,CommandBuffer const&cb);
+
+/**
+ * @brief This function submits compiled command stream (copied, same rules as izg_submit of command buffer)
+ */
+GPUFence izg_submit(GPUMemory&mem,CompiledCommandBuffer const&compiled);
+
+/**
+ * @brief This function tests whether submitted command buffer is executed
+ *
+ * @param fence fence from izg_submit
+ *
+ * @return true if fence is signaled
+ */
+bool izg_poll(GPUFence fence);
+
+/**
+ * @brief This function waits until submitted command buffer is executed
+ *
+ * @param fence fence from izg_submit
+ */
+void izg_wait(GPUFence fence);
+
+/**
+ * @brief This function waits until all submitted command buffers are executed (izg_enqueue calls it first)
+ */
+void izg_finish();
@@ -5,53 +5,380 @@
  * @author Tomáš Milet, imilet@fit.vutbr.cz
  */
 #include <student/prepareModel.hpp>
+#include <student/prepareModelExt.hpp>
 #include <student/gpu.hpp>
 
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstring>
+
 ///\endcond
-void prepareNode(GPUMemory&mem,CommandBuffer&cb,Node const&node,Model const&model,glm::mat4 const&matrix, uint32_t& drawCounter){
-  if(node.mesh > -1) {
-    Mesh mesh = model.meshes[node.mesh];
 
-    VertexArray va = {
-      .indexBufferID = mesh.indexBufferID,
-      .indexOffset = mesh.indexOffset,
-      .indexType = mesh.indexType
-    };
+// Pocet plnych priprav draw listu (SceneDrawList::generation)
+static std::atomic<uint64_t> generations{0};
 
-    va.vertexAttrib[0] = mesh.position;
-    va.vertexAttrib[1] = mesh.normal;
-    va.vertexAttrib[2] = mesh.texCoord;
+static bool sameAttrib(VertexAttrib const&a,VertexAttrib const&b){
+  return a.bufferID == b.bufferID && a.stride == b.stride && a.offset == b.offset && a.type == b.type;
+}
 
-    mem.vertexArrays[drawCounter] = va;
+static bool sameMesh(Mesh const&a,Mesh const&b){
+  return sameAttrib(a.position, b.position) && sameAttrib(a.normal, b.normal) && sameAttrib(a.texCoord, b.texCoord) &&
+         a.nofIndices == b.nofIndices && a.indexOffset == b.indexOffset && a.indexBufferID == b.indexBufferID &&
+         a.indexType == b.indexType && a.diffuseColor == b.diffuseColor && a.diffuseTexture == b.diffuseTexture &&
+         a.doubleSided == b.doubleSided;
+}
 
-    /// Command BufferS
-    BindVertexArrayCommand bindVaCmd = {.id = drawCounter};
-    cb.commands[cb.nofCommands].data.bindVertexArrayCommand = bindVaCmd;
-    cb.commands[cb.nofCommands++].type = CommandType::BIND_VERTEXARRAY;
+static bool sameBuffer(Buffer const&a,Buffer const&b){
+  return a.data == b.data && a.size == b.size;
+}
 
-    DrawCommand drawCmd;
-    drawCmd.backfaceCulling = mesh.doubleSided ? false : true;
-    drawCmd.nofVertices = mesh.nofIndices;
-    cb.commands[cb.nofCommands].data.drawCommand = drawCmd;
-    cb.commands[cb.nofCommands++].type = CommandType::DRAW;
+static bool sameTexture(Texture const&a,Texture const&b){
+  return a.img.data == b.img.data && a.img.format == b.img.format && a.img.channels == b.img.channels &&
+         a.img.bytesPerPixel == b.img.bytesPerPixel && a.img.pitch == b.img.pitch && a.width == b.width && a.height == b.height;
+}
 
-    /// Prubezna matice, inverzni-transponovana matice
-    glm::mat4 modelMatrix = matrix * node.modelMatrix;
-    glm::mat4 inverseModelMatrix = glm::transpose(glm::inverse(modelMatrix));
+static bool sameVertexArray(VertexArray const&a,VertexArray const&b){
+  for (uint32_t i = 0; i < sizeof(a.vertexAttrib) / sizeof(VertexAttrib); ++i)
+    if(!sameAttrib(a.vertexAttrib[i], b.vertexAttrib[i]))
+      return false;
+  return a.indexBufferID == b.indexBufferID && a.indexOffset == b.indexOffset && a.indexType == b.indexType;
+}
 
-    mem.uniforms[10+(drawCounter)*5+0].m4 = modelMatrix;
-    mem.uniforms[10+(drawCounter)*5+1].m4 = inverseModelMatrix;
-    mem.uniforms[10+(drawCounter)*5+2].v4 = mesh.diffuseColor;
-    mem.uniforms[10+(drawCounter)*5+3].i1 = mesh.diffuseTexture;
-    mem.uniforms[10+(drawCounter)*5+4].v1 = mesh.doubleSided;
+template<typename T>
+static bool sameContent(std::vector<T> const&a,std::vector<T> const&b,bool(*same)(T const&,T const&)){
+  if(a.size() != b.size())
+    return false;
+  for (size_t i = 0; i < a.size(); ++i)
+    if(!same(a[i], b[i]))
+      return false;
+  return true;
+}
 
-    ++drawCounter;
+/// Pozice vrcholu meshe: indexy cele, jinak pouzite vrcholy
+static BoundingBox meshBounds(Mesh const&mesh,Model const&model){
+  BoundingBox box;
+  VertexAttrib const&position = mesh.position;
+  if(position.bufferID < 0 || (position.type != AttributeType::VEC3 && position.type != AttributeType::VEC4)){
+    box.min = glm::vec3(-INFINITY);
+    box.max = glm::vec3(+INFINITY);
+    return box;
   }
-  
+
+  uint8_t const*vertices = (uint8_t const*)model.buffers[position.bufferID].data + position.offset;
+  uint8_t const*indices  = mesh.indexBufferID < 0 ? nullptr : (uint8_t const*)model.buffers[mesh.indexBufferID].data + mesh.indexOffset;
+
+  for (uint32_t i = 0; i < mesh.nofIndices; ++i){
+    uint32_t id = i;
+    if(indices){
+      if(mesh.indexType == IndexType::UINT8 ) id = ((uint8_t  const*)indices)[i];
+      if(mesh.indexType == IndexType::UINT16) id = ((uint16_t const*)indices)[i];
+      if(mesh.indexType == IndexType::UINT32) id = ((uint32_t const*)indices)[i];
+    }
+    glm::vec3 p;
+    std::memcpy(&p, vertices + id * position.stride, sizeof(p));
+    box.min = glm::min(box.min, p);
+    box.max = glm::max(box.max, p);
+  }
+  return box;
+}
+
+/// Svetovy box meshe uzlu z rohu boxu v souradnicich meshe
+static BoundingBox worldBounds(BoundingBox const&local,glm::mat4 const&world){
+  BoundingBox box;
+  if(!(local.min.x <= local.max.x))
+    return box;
+  if(!std::isfinite(local.min.x) || !std::isfinite(local.max.x))
+    return local;
+
+  for (uint32_t c = 0; c < 8; ++c){
+    glm::vec3 corner(c & 1 ? local.max.x : local.min.x, c & 2 ? local.max.y : local.min.y, c & 4 ? local.max.z : local.min.z);
+    glm::vec3 p = glm::vec3(world * glm::vec4(corner, 1.f));
+    box.min = glm::min(box.min, p);
+    box.max = glm::max(box.max, p);
+  }
+  return box;
+}
+
+/// Zplosteni podstromu v pre-order poradi, instances[mesh] = uzly s meshem
+void prepareNode(SceneDrawList&list,std::vector<std::vector<uint32_t>>&instances,Node const&node,int32_t parent){
+  uint32_t index = (uint32_t) list.nodes.size();
+
+  SceneNode flat;
+  flat.parent = parent;
+  flat.mesh   = node.mesh;
+  flat.object = 0;
+  flat.local  = node.modelMatrix;
+  flat.world  = parent < 0 ? node.modelMatrix : list.nodes[parent].world * node.modelMatrix;
+  flat.normal = glm::transpose(glm::inverse(flat.world));
+  list.nodes.push_back(flat);
+
+  if(node.mesh > -1)
+    instances[node.mesh].push_back(index);
+
   for(size_t i = 0; i < node.children.size(); ++i)
-    prepareNode(mem, cb, node.children[i], model, matrix * node.modelMatrix, drawCounter);
+    prepareNode(list, instances, node.children[i], (int32_t) index);
+
+  list.nodes[index].end = (uint32_t) list.nodes.size();
+}
+
+/// Matice objektu uzlu do jeho slotu uniform
+static void writeObjectMatrices(GPUMemory&mem,SceneNode const&node){
+  mem.uniforms[10+node.object*5+0].m4 = node.world;
+  mem.uniforms[10+node.object*5+1].m4 = node.normal;
+}
+
+/// VertexArray meshe: pozice, normala a texturovaci souradnice
+static VertexArray meshVertexArray(Mesh const&mesh){
+  VertexArray va = {
+    .indexBufferID = mesh.indexBufferID,
+    .indexOffset = mesh.indexOffset,
+    .indexType = mesh.indexType
+  };
+
+  va.vertexAttrib[0] = mesh.position;
+  va.vertexAttrib[1] = mesh.normal;
+  va.vertexAttrib[2] = mesh.texCoord;
+  return va;
+}
+
+/// Box a uniformy objektu uzlu n (node.object uz je prideleny)
+static void prepareObject(SceneDrawList&list,GPUMemory&mem,Mesh const&mesh,uint32_t n){
+  SceneNode const& node = list.nodes[n];
+  list.cullNodes[n+1].object    = (int32_t) node.object;
+  list.cullNodes[n+1].objectBox = worldBounds(list.meshBounds[node.mesh], node.world);
+  writeObjectMatrices(mem, node);
+  mem.uniforms[10+node.object*5+2].v4 = mesh.diffuseColor;
+  mem.uniforms[10+node.object*5+3].i1 = mesh.diffuseTexture;
+  mem.uniforms[10+node.object*5+4].v1 = mesh.doubleSided;
+}
+
+static void merge(BoundingBox&box,BoundingBox const&other){
+  box.min = glm::min(box.min, other.min);
+  box.max = glm::max(box.max, other.max);
+}
+
+/// Box podstromu uzlu n z boxu jeho objektu a podstromu potomku (uzel n-1 = koren cele sceny)
+static void subtreeBounds(SceneDrawList&list,int32_t n){
+  CullNode& node = list.cullNodes[n+1];
+  node.bounds = node.objectBox;
+  uint32_t end = n < 0 ? (uint32_t) list.nodes.size() : list.nodes[n].end;
+  for (uint32_t c = n + 1; c < end; c = list.nodes[c].end)
+    merge(node.bounds, list.cullNodes[c+1].bounds);
+}
+
+/// VertexArray, zaznamy a uniformy objektu v rozlozeni list.multiDraw
+static void prepareObjects(SceneDrawList&list,GPUMemory&mem,Model const&model,std::vector<std::vector<uint32_t>> const&instances){
+  uint32_t drawCounter = 0;
+
+  // Standardni rozlozeni: kazdy uzel s meshem v pre-order poradi ma vlastni VertexArray a DRAW, gl_DrawID = poradi uzlu
+  if(!list.multiDraw){
+    for (uint32_t n = 0; n < list.nodes.size(); ++n){
+      SceneNode& node = list.nodes[n];
+      if(node.mesh < 0)
+        continue;
+
+      Mesh const& mesh = model.meshes[node.mesh];
+      node.object = drawCounter++;
+      mem.vertexArrays[node.object] = meshVertexArray(mesh);
+
+      DrawRecord record;
+      record.vertexArray = node.object;
+      record.nofVertices = mesh.nofIndices;
+      record.drawID = node.object;
+      record.backfaceCulling = mesh.doubleSided ? false : true;
+      list.records.push_back(record);
+
+      prepareObject(list, mem, mesh, n);
+    }
+    return;
+  }
+
+  // Slozene rozlozeni: kazdy mesh ma jeden VertexArray a jeden zaznam MULTI_DRAW se vsemi vyskyty jako instancemi,
+  // instance i zaznamu s gl_DrawID d pouziva uniformy objektu d + i
+  for (uint32_t m = 0; m < model.meshes.size(); ++m){
+    if(instances[m].empty())
+      continue;
+
+    Mesh const& mesh = model.meshes[m];
+    mem.vertexArrays[m] = meshVertexArray(mesh);
+
+    DrawRecord record;
+    record.vertexArray = m;
+    record.nofVertices = mesh.nofIndices;
+    record.nofInstances = (uint32_t) instances[m].size();
+    record.drawID = drawCounter;
+    record.backfaceCulling = mesh.doubleSided ? false : true;
+    list.records.push_back(record);
+
+    for (uint32_t n : instances[m]){
+      SceneNode& node = list.nodes[n];
+      node.object = drawCounter++;
+      prepareObject(list, mem, mesh, n);
+    }
+  }
+}
+
+void prepareSceneDrawList(SceneDrawList&list,GPUMemory&mem,Model const&model,bool multiDraw){
+  // List plati az po dokonceni prepareModel
+  list.mem = nullptr;
+  list.generation = 0;
+
+  list.nodes.clear();
+  list.records.clear();
+  list.multiDraw = multiDraw;
+
+  // Boxy meshu z bufferu pozic, jen pro jine meshe nebo buffery
+  if(!sameContent(list.meshes, model.meshes, sameMesh) || !sameContent(list.buffers, model.buffers, sameBuffer) ||
+     list.meshBounds.size() != model.meshes.size()){
+    list.meshBounds.resize(model.meshes.size());
+    for (uint32_t m = 0; m < model.meshes.size(); ++m)
+      list.meshBounds[m] = meshBounds(model.meshes[m], model);
+    list.meshes  = model.meshes;
+    list.buffers = model.buffers;
+  }
+
+  std::vector<std::vector<uint32_t>> instances(model.meshes.size());
+  for (size_t i = 0; i < model.roots.size(); ++i)
+    prepareNode(list, instances, model.roots[i], -1);
+  list.dirty.assign(list.nodes.size(), 0);
+
+  // Hierarchie orezani kopiruje strom uzlu, pred nim je koren cele sceny
+  list.cullNodes.assign(list.nodes.size() + 1, CullNode());
+  for (uint32_t n = 0; n < list.nodes.size(); ++n)
+    list.cullNodes[n+1].end = list.nodes[n].end + 1;
+  list.cullNodes[0].end = (uint32_t) list.cullNodes.size();
+
+  prepareObjects(list, mem, model, instances);
+
+  // Boxy podstromu od listu ke korenum
+  for (int32_t n = (int32_t) list.nodes.size(); n-- > -1;)
+    subtreeBounds(list, n);
+}
+
+void setSceneNodeMatrix(SceneDrawList&list,uint32_t node,glm::mat4 const&modelMatrix){
+  list.nodes[node].local = modelMatrix;
+  list.dirty[node] = 1;
+}
+
+void updateSceneDrawList(SceneDrawList&list,GPUMemory&mem){
+  // Rodic ma vzdy mensi index, podstrom zmeneneho uzlu se prepocita cely a preskoci
+  bool changed = false;
+  for (uint32_t i = 0; i < list.nodes.size();){
+    if(!list.dirty[i]){
+      ++i;
+      continue;
+    }
+
+    uint32_t end = list.nodes[i].end;
+    for (uint32_t n = i; n < end; ++n){
+      SceneNode& node = list.nodes[n];
+      node.world  = node.parent < 0 ? node.local : list.nodes[node.parent].world * node.local;
+      node.normal = glm::transpose(glm::inverse(node.world));
+      if(node.mesh > -1){
+        list.cullNodes[n+1].objectBox = worldBounds(list.meshBounds[node.mesh], node.world);
+        writeObjectMatrices(mem, node);
+      }
+      list.dirty[n] = 0;
+    }
+
+    // Boxy podstromu zmenenych uzlu a jejich predku
+    for (uint32_t n = end; n-- > i;)
+      subtreeBounds(list, (int32_t) n);
+    for (int32_t p = list.nodes[i].parent; p >= 0; p = list.nodes[p].parent)
+      subtreeBounds(list, p);
+    changed = true;
+    i = end;
+  }
+  if(changed)
+    subtreeBounds(list, -1);
+}
+
+void pushSceneDrawList(CommandBuffer&cb,SceneDrawList const&list){
+  // Standardni rozlozeni: BIND_VERTEXARRAY a DRAW pro kazdy uzel, gl_DrawID pocitaji samy DRAW
+  if(!list.multiDraw){
+    for(DrawRecord const& record : list.records){
+      BindVertexArrayCommand bindVertexArray;
+      bindVertexArray.id = record.vertexArray;
+      izg_pushCommand(cb, CommandType::BIND_VERTEXARRAY, bindVertexArray);
+
+      DrawCommand draw;
+      draw.backfaceCulling = record.backfaceCulling;
+      draw.nofVertices = record.nofVertices;
+      izg_pushCommand(cb, CommandType::DRAW, draw);
+    }
+    return;
+  }
+
+  // Objekty se orezavaji az pri provadeni podle kamery v uniforms[0]
+  MultiDrawCommand multiDraw;
+  multiDraw.records = list.records.data();
+  multiDraw.nofRecords = (uint32_t) list.records.size();
+  multiDraw.cullUniform = 0;
+  multiDraw.cullNodes = list.cullNodes.data();
+  if(multiDraw.nofRecords)
+    izg_pushCommand(cb, MULTI_DRAW, multiDraw);
+}
+
+void prepareDeferredShading(GPUMemory&mem){
+  // Pruchod geometrie: stejny vertex shader, barva se nezapisuje, jen hloubka a G-buffer
+  Program& geometry = mem.programs[deferredGeometryProgram];
+  geometry = Program();
+  geometry.vertexShader = drawModel_vertexShader;
+  geometry.fragmentShader = drawModel_gbufferFragmentShader;
+  geometry.vs2fs[0] = AttributeType::VEC3;
+  geometry.vs2fs[1] = AttributeType::VEC3;
+  geometry.vs2fs[2] = AttributeType::VEC2;
+
+  ProgramSettings& geometrySettings = izg_programSettings(deferredGeometryProgram);
+  geometrySettings = ProgramSettings();
+  geometrySettings.prepare = drawModel_prepare;
+  geometrySettings.colorWrite = false;
+  geometrySettings.nofUniforms = 10;
+  geometrySettings.uniformsPerDraw = 5;
+
+  // G-buffer alokuje gpu podle velikosti framebufferu, do ktereho se pri provadeni kresli
+  for (uint32_t t = 0; t < nofGBufferTargets; ++t)
+    geometrySettings.renderTargets[t] = gbufferTexture+t;
+
+  // Pruchod osvetleni: trojuhelnik pres obrazovku na near rovine, hloubka se jen testuje
+  Program& lighting = mem.programs[deferredLightingProgram];
+  lighting = Program();
+  lighting.vertexShader = drawModel_lightingVertexShader;
+  lighting.fragmentShader = drawModel_lightingFragmentShader;
+
+  ProgramSettings& lightingSettings = izg_programSettings(deferredLightingProgram);
+  lightingSettings = ProgramSettings();
+  lightingSettings.fragmentShaderBatch = drawModel_lightingFragmentShaderBatch;
+  lightingSettings.depthWrite = false;
+  lightingSettings.nofUniforms = 10;
+
+  mem.vertexArrays[deferredLightingVertexArray] = VertexArray();
+}
+
+void pushDeferredShading(CommandBuffer&cb,SceneDrawList const&list){
+  BindProgramCommand bindProgram;
+  bindProgram.id = deferredGeometryProgram;
+  izg_pushCommand(cb, CommandType::BIND_PROGRAM, bindProgram);
+
+  // G-buffer se cisti pred kazdym pruchodem geometrie, nepokryte pixely osvetleni zahodi (position.w = 0)
+  izg_pushCommand(cb, CLEAR_TARGETS, ClearTargetsCommand());
+  pushSceneDrawList(cb, list);
+
+  bindProgram.id = deferredLightingProgram;
+  izg_pushCommand(cb, CommandType::BIND_PROGRAM, bindProgram);
+
+  BindVertexArrayCommand bindVertexArray;
+  bindVertexArray.id = deferredLightingVertexArray;
+  izg_pushCommand(cb, CommandType::BIND_VERTEXARRAY, bindVertexArray);
+
+  DrawCommand draw;
+  draw.nofVertices = 3;
+  izg_pushCommand(cb, CommandType::DRAW, draw);
 }
 
+static void prepareModelInto(GPUMemory&mem,CommandBuffer&commandBuffer,Model const&model,SceneDrawList&drawList,bool multiDraw);
+
 /**
  * @brief This function prepares model into memory and creates command buffer
  *
@@ -61,29 +388,165 @@ void prepareNode(GPUMemory&mem,CommandBuffer&cb,Node const&node,Model const&mode
  */
 //! [drawModel]
 void prepareModel(GPUMemory&mem,CommandBuffer&commandBuffer,Model const&model){
-  (void)mem;
-  (void)commandBuffer;
-  (void)model;
   /// \todo Tato funkce připraví command buffer pro model a nastaví správně pamět grafické karty.<br>
   /// Vaším úkolem je správně projít model a vložit vykreslovací příkazy do commandBufferu.
   /// Zároveň musíte vložit do paměti textury, buffery a uniformní proměnné, které buffer command buffer využívat.
   /// Bližší informace jsou uvedeny na hlavní stránce dokumentace a v testech.
 
-  /// Nastaveni pameti gpu
-  for (uint32_t i = 0; i < model.buffers.size(); ++i)
-    mem.buffers[i] = model.buffers[i];
+  // Vzdy plna priprava ve standardnim rozlozeni, prikazy nezavisi na zadnem listu
+  SceneDrawList drawList;
+  prepareModelInto(mem, commandBuffer, model, drawList, false);
+}
+//! [drawModel]
 
-   for (uint32_t i = 0; i < model.textures.size(); ++i)
-    mem.textures[i] = model.textures[i];   
+/// Programy se shadery drawModel (napr. program 0 frameworku) pripravi konstanty jednou za DRAW, vlastni prepare programu zustava
+static void registerDrawModelPrepare(GPUMemory const&mem){
+  for (uint32_t p = 0; p < sizeof(mem.programs) / sizeof(Program); ++p){
+    Program const& program = mem.programs[p];
+    ProgramSettings& settings = izg_programSettings(p);
+    if(settings.prepare == nullptr && (program.vertexShader == drawModel_vertexShader || program.fragmentShader == drawModel_fragmentShader))
+      settings.prepare = drawModel_prepare;
 
-  glm::mat4 matrix = glm::mat4(1.f);
+    // Oba shadery ctou jen uniformy sceny a objektu gl_DrawID, izg_submit kopiruje jen ty
+    if(program.vertexShader == drawModel_vertexShader && program.fragmentShader == drawModel_fragmentShader){
+      settings.nofUniforms = 10;
+      settings.uniformsPerDraw = 5;
+    }
+  }
+}
 
-  uint32_t drawCounter = 0;
+/// Porovnani podstromu modelu se zplostenymi uzly, zmenene matice se oznaci (false = jina struktura stromu)
+static bool matchNode(SceneDrawList&list,Node const&node,int32_t parent,uint32_t&index){
+  if(index >= list.nodes.size() || list.nodes[index].mesh != node.mesh || list.nodes[index].parent != parent)
+    return false;
 
+  uint32_t n = index++;
+  if(list.nodes[n].local != node.modelMatrix)
+    setSceneNodeMatrix(list, n, node.modelMatrix);
+  for(size_t i = 0; i < node.children.size(); ++i)
+    if(!matchNode(list, node.children[i], (int32_t) n, index))
+      return false;
+  return index == list.nodes[n].end;
+}
+
+/// Draw list je pripraveny ze stejneho obsahu modelu a pamet gpu stale obsahuje vse, co do ni priprava zapsala
+static bool isPrepared(SceneDrawList&list,GPUMemory const&mem,Model const&model,bool multiDraw){
+  if(list.generation == 0 || list.mem != &mem || list.multiDraw != multiDraw ||
+     list.filter != izg_settings().textureFilter || list.compression != izg_settings().textureCompression)
+    return false;
+
+  // Obsah modelu (ne jeho adresa, ta se muze opakovat)
+  if(!sameContent(list.meshes, model.meshes, sameMesh) || !sameContent(list.buffers, model.buffers, sameBuffer) ||
+     !sameContent(list.textures, model.textures, sameTexture))
+    return false;
+
+  // Pamet gpu mezitim mohl prepsat jiny model
+  for (uint32_t i = 0; i < list.buffers.size(); ++i)
+    if(!sameBuffer(mem.buffers[i], list.buffers[i]))
+      return false;
+  for (uint32_t i = 0; i < list.textures.size(); ++i)
+    if(izg_textureUpload(mem.textures[i]) != list.uploads[i])
+      return false;
+  for(SceneNode const& node : list.nodes){
+    if(node.mesh < 0)
+      continue;
+    Mesh const& mesh = list.meshes[node.mesh];
+    Uniform const* uniforms = mem.uniforms + 10 + node.object * 5;
+    if(!sameVertexArray(mem.vertexArrays[multiDraw ? node.mesh : node.object], meshVertexArray(mesh)) ||
+       uniforms[0].m4 != node.world || uniforms[1].m4 != node.normal || uniforms[2].v4 != mesh.diffuseColor ||
+       uniforms[3].i1 != mesh.diffuseTexture || uniforms[4].v1 != (float) mesh.doubleSided)
+      return false;
+  }
+
+  uint32_t index = 0;
   for (size_t i = 0; i < model.roots.size(); ++i)
-    prepareNode(mem, commandBuffer, model.roots[i], model, matrix, drawCounter);
+    if(!matchNode(list, model.roots[i], -1, index))
+      return false;
+  return index == list.nodes.size();
+}
+
+/// Priprava modelu do draw listu v danem rozlozeni a prikazy do command bufferu
+static void prepareModelInto(GPUMemory&mem,CommandBuffer&commandBuffer,Model const&model,SceneDrawList&drawList,bool multiDraw){
+  // Opakovane volani pro stejny model prepocita jen zmenene matice uzlu
+  if(isPrepared(drawList, mem, model, multiDraw))
+    updateSceneDrawList(drawList, mem);
+  else{
+    /// Nastaveni pameti gpu
+    for (uint32_t i = 0; i < model.buffers.size(); ++i)
+      mem.buffers[i] = model.buffers[i];
+
+    // Textury se nahraji s mip urovnemi po dlazdicich
+    for (uint32_t i = 0; i < model.textures.size(); ++i)
+      izg_uploadTexture(mem, i, model.textures[i], izg_settings().textureFilter, izg_settings().textureCompression);
+
+    /// Zplosteny strom s maticemi a sloty uniform, zaznamy draw listu se do command bufferu zkopiruji az pri kompilaci
+    prepareSceneDrawList(drawList, mem, model, multiDraw);
+
+    drawList.textures = model.textures;
+    drawList.uploads.resize(model.textures.size());
+    for (uint32_t i = 0; i < model.textures.size(); ++i)
+      drawList.uploads[i] = izg_textureUpload(mem.textures[i]);
+    drawList.filter      = izg_settings().textureFilter;
+    drawList.compression = izg_settings().textureCompression;
+    drawList.mem         = &mem;
+    drawList.generation  = ++generations;
+  }
+
+  registerDrawModelPrepare(mem);
+
+  // Odlozene stinovani: osvetleni jednou na pixel misto jednou na fragment, jen pokud model nepouziva vyhrazene sloty
+  uint32_t nofVertexArrays = 0;
+  for(DrawRecord const& record : drawList.records)
+    nofVertexArrays = std::max(nofVertexArrays, record.vertexArray + 1);
+  bool reservedFree = model.textures.size() <= gbufferTexture && nofVertexArrays <= deferredLightingVertexArray;
+  if(izg_settings().deferredShading && reservedFree){
+    prepareDeferredShading(mem);
+    pushDeferredShading(commandBuffer, drawList);
+  } else {
+    // Aplikace se o doprednem vykresleni dozvi ze statistik
+    if(izg_settings().deferredShading)
+      ++izg_statistics().deferredFallbacks;
+    pushSceneDrawList(commandBuffer, drawList);
+  }
+}
+
+void prepareModel(GPUMemory&mem,CommandBuffer&commandBuffer,Model const&model,SceneDrawList&drawList){
+  prepareModelInto(mem, commandBuffer, model, drawList, izg_settings().multiDraw);
+}
+
+/// Objekt sceny, jehoz uniformy DRAW pouziva (instance nasleduji za sebou od gl_DrawID)
+static uint32_t drawModel_object(ShaderInterface const&si){
+  return si.gl_DrawID + izg_instanceID();
+}
+
+/// Konstanty vertex shaderu - soucin matic jednou pro DRAW misto pro kazdy vrchol
+static void drawModel_prepareVertex(DrawModelConstants&c,ShaderInterface const&si){
+  uint32_t object     = drawModel_object(si);
+  c.model             = si.uniforms[10+object*5+0].m4;
+  c.inverseTransposed = si.uniforms[10+object*5+1].m4;
+  c.cameraModel       = si.uniforms[0].m4 * c.model;
+  c.lightModel        = si.uniforms[3].m4 * c.model;
+}
+
+/// Konstanty fragment shaderu - vyresena textura a barvy svetel
+static void drawModel_prepareFragment(DrawModelConstants&c,ShaderInterface const&si){
+  uint32_t object     = drawModel_object(si);
+  int32_t texture     = si.uniforms[10+object*5+3].i1;
+  c.texture           = texture > -1 ? si.textures + texture : nullptr;
+  c.textureGradients  = c.texture && izg_textureNeedsDerivatives(*c.texture);
+  c.diffuseColor      = si.uniforms[10+object*5+2].v4;
+  c.doubleSided       = si.uniforms[10+object*5+4].v1;
+  c.lightPosition     = si.uniforms[1].v3;
+  c.cameraPosition    = si.uniforms[2].v3;
+  c.ambientLightColor = si.uniforms[7].v3;
+  c.lightColor        = si.uniforms[8].v3;
+}
+
+void drawModel_prepare(void*constants,ShaderInterface const&si){
+  DrawModelConstants&c = *(DrawModelConstants*)constants;
+  drawModel_prepareVertex(c, si);
+  drawModel_prepareFragment(c, si);
 }
-//! [drawModel]
 
 /**
  * @brief This function represents vertex shader of texture rendering method.
@@ -101,16 +564,24 @@ void drawModel_vertexShader(OutVertex&outVertex,InVertex const&inVertex,ShaderIn
   /// Vaším úkolem je správně trasnformovat vrcholy modelu.
   /// Bližší informace jsou uvedeny na hlavní stránce dokumentace.
 
+  // Konstanty DRAW, pokud je nevyplnil drawModel_prepare, spocitaji se zde
+  DrawModelConstants local;
+  auto c = (DrawModelConstants const*) izg_drawConstants(drawModel_prepare);
+  if(c == nullptr){
+    drawModel_prepareVertex(local, si);
+    c = &local;
+  }
+
   //Pozice vrcholu gl_Position by měla být vypočtena pronásobením cameraProjectionView*model*pos.
-  outVertex.gl_Position = si.uniforms[0].m4 * si.uniforms[10+si.gl_DrawID*5+0].m4 * glm::vec4(inVertex.attributes[0].v3, 1.f);
+  outVertex.gl_Position = c->cameraModel * glm::vec4(inVertex.attributes[0].v3, 1.f);
   //Pozice by se měla pronásobit modelovou maticí "m*glm::vec4(pos,1.f)", aby se ztransformovala do world-space.
-  outVertex.attributes[0].v3 = si.uniforms[10+si.gl_DrawID*5+0].m4 * glm::vec4(inVertex.attributes[0].v3, 1.f); //pozice ve world space
+  outVertex.attributes[0].v3 = c->model * glm::vec4(inVertex.attributes[0].v3, 1.f); //pozice ve world space
   //Normála by se měla pronásobit inverzní transponovanou modelovou maticí "itm*glm::vec4(nor,0.f)" aby se dostala do world-space.
-  outVertex.attributes[1].v3 = si.uniforms[10+si.gl_DrawID*5+1].m4 * glm::vec4(inVertex.attributes[1].v3, 0.f); //normala ve world space
+  outVertex.attributes[1].v3 = c->inverseTransposed * glm::vec4(inVertex.attributes[1].v3, 0.f); //normala ve world space
   //Texturovací souřadnice se pouze přepošlou.
   outVertex.attributes[2].v2 = inVertex.attributes[2].v2; //tex. koordinaty
   //Pozice vrcholu v prostoru clip-space prostoru světla pro stíny by se měla vypočítat lightProjectionView*model*pos.
-  outVertex.attributes[3].v4 = si.uniforms[3].m4 * si.uniforms[10+si.gl_DrawID*5+0].m4 * glm::vec4(inVertex.attributes[0].v3, 1.f);
+  outVertex.attributes[3].v4 = c->lightModel * glm::vec4(inVertex.attributes[0].v3, 1.f);
 }
 //! [drawModel_vs]
 
@@ -132,25 +603,37 @@ void drawModel_fragmentShader(OutFragment&outFragment,InFragment const&inFragmen
   /// Vaším úkolem je správně obarvit fragmenty a osvětlit je pomocí lambertova osvětlovacího modelu.
   /// Bližší informace jsou uvedeny na hlavní stránce dokumentace.
   
+  // Konstanty DRAW, pokud je nevyplnil drawModel_prepare, spocitaji se zde
+  DrawModelConstants local;
+  auto c = (DrawModelConstants const*) izg_drawConstants(drawModel_prepare);
+  if(c == nullptr){
+    drawModel_prepareFragment(local, si);
+    c = &local;
+  }
+
   auto pozice = inFragment.attributes[0].v3;
   auto nor = inFragment.attributes[1].v3;
   auto UV = inFragment.attributes[2].v2;
   auto clipPozice = inFragment.attributes[3].v4;
   auto N=glm::normalize(nor);
-  auto doubleSided = si.uniforms[10+si.gl_DrawID*5+4].v1;
+  auto doubleSided = c->doubleSided;
   glm::vec4 dC; //barva povrchu nebo textura
-  glm::vec3 ambientLightColor = si.uniforms[7].v3;
-  glm::vec3 lightColor = si.uniforms[8].v3;
+  glm::vec3 ambientLightColor = c->ambientLightColor;
+  glm::vec3 lightColor = c->lightColor;
 
-  if(doubleSided && glm::dot(nor, pozice - si.uniforms[2].v3) >= 0)
+  if(doubleSided && glm::dot(nor, pozice - c->cameraPosition) >= 0)
     nor = -nor;
   
   // textura nebo barva   
-  if(si.uniforms[10+si.gl_DrawID*5+3].i1 > -1) {
-    dC = read_texture(si.textures[si.uniforms[10+si.gl_DrawID*5+3].i1], UV);
-  } else dC = si.uniforms[10+si.gl_DrawID*5+2].v4;
+  if(c->texture) {
+    // Mip uroven podle zmeny UV mezi sousednimi pixely
+    glm::vec4 dUVdx = glm::vec4(0.f), dUVdy = glm::vec4(0.f);
+    if(c->textureGradients)
+      izg_derivatives(2, inFragment.gl_FragCoord, dUVdx, dUVdy);
+    dC = read_textureGrad(*c->texture, UV, glm::vec2(dUVdx), glm::vec2(dUVdy));
+  } else dC = c->diffuseColor;
 
-  auto L = glm::normalize(pozice - si.uniforms[1].v3);
+  auto L = glm::normalize(pozice - c->lightPosition);
   float dF = glm::clamp(glm::dot(L,N),0.f,1.f);
 
   glm::vec3 aL = glm::vec3(dC) * ambientLightColor;
@@ -165,3 +648,176 @@ void drawModel_fragmentShader(OutFragment&outFragment,InFragment const&inFragmen
 }
 //! [drawModel_fs]
 
+void drawModel_gbufferFragmentShader(OutFragment&outFragment,InFragment const&inFragment,ShaderInterface const&si){
+  // Konstanty DRAW, pokud je nevyplnil drawModel_prepare, spocitaji se zde
+  DrawModelConstants local;
+  auto c = (DrawModelConstants const*) izg_drawConstants(drawModel_prepare);
+  if(c == nullptr){
+    drawModel_prepareFragment(local, si);
+    c = &local;
+  }
+
+  auto pozice = inFragment.attributes[0].v3;
+  auto N = glm::normalize(inFragment.attributes[1].v3);
+  auto UV = inFragment.attributes[2].v2;
+
+  // textura nebo barva
+  glm::vec4 dC = c->diffuseColor;
+  if(c->texture){
+    glm::vec4 dUVdx = glm::vec4(0.f), dUVdy = glm::vec4(0.f);
+    if(c->textureGradients)
+      izg_derivatives(2, inFragment.gl_FragCoord, dUVdx, dUVdy);
+    dC = read_textureGrad(*c->texture, UV, glm::vec2(dUVdx), glm::vec2(dUVdy));
+  }
+
+  // Alfa test uz v geometrii, zahozeny fragment neprekryje povrch za nim
+  if(dC.a < 0.5f){
+    outFragment.discard = true;
+    return;
+  }
+
+  izg_fragmentOutput(0, glm::vec4(pozice, 1.f));
+  izg_fragmentOutput(1, glm::vec4(N, (float) drawModel_object(si)));
+  izg_fragmentOutput(2, dC);
+}
+
+void drawModel_lightingVertexShader(OutVertex&outVertex,InVertex const&inVertex,ShaderInterface const&si){
+  (void)si;
+  // Vrcholy (-1,-1), (3,-1), (-1,3) - trojuhelnik pokryje cely viewport
+  float x = inVertex.gl_VertexID == 1 ? 3.f : -1.f;
+  float y = inVertex.gl_VertexID == 2 ? 3.f : -1.f;
+  outVertex.gl_Position = glm::vec4(x, y, -1.f, 1.f);
+}
+
+void drawModel_lightingFragmentShader(OutFragment&outFragment,InFragment const&inFragment,ShaderInterface const&si){
+  glm::uvec2 pixel = glm::uvec2(glm::vec2(inFragment.gl_FragCoord));
+
+  // Pixel bez povrchu (G-buffer vycisteny na nuly) si ponecha barvu pozadi
+  glm::vec4 pozice = texelFetch(si.textures[gbufferTexture+0], pixel);
+  if(pozice.w == 0.f){
+    outFragment.discard = true;
+    return;
+  }
+  glm::vec3 N = glm::vec3(texelFetch(si.textures[gbufferTexture+1], pixel));
+  glm::vec4 dC = texelFetch(si.textures[gbufferTexture+2], pixel);
+
+  // Stejny lambertuv model jako drawModel_fragmentShader
+  auto L = glm::normalize(glm::vec3(pozice) - si.uniforms[1].v3);
+  float dF = glm::clamp(glm::dot(L,N),0.f,1.f);
+
+  glm::vec3 aL = glm::vec3(dC) * si.uniforms[7].v3;
+  glm::vec3 dL = glm::vec3(dC) * si.uniforms[8].v3 * dF;
+
+  outFragment.gl_FragColor = glm::vec4(aL+dL, dC.a);
+}
+
+void drawModel_lightingFragmentShaderBatch(OutFragmentBatch&outFragment,InFragmentBatch const&inFragment,ShaderInterface const&si){
+  glm::vec3 lightPosition = si.uniforms[1].v3;
+  glm::vec3 ambientLightColor = si.uniforms[7].v3;
+  glm::vec3 lightColor = si.uniforms[8].v3;
+
+  for (uint32_t i = 0; i < shaderBatchSize; ++i){
+    glm::uvec2 pixel = glm::uvec2(glm::vec2(inFragment.gl_FragCoord.v[0][i], inFragment.gl_FragCoord.v[1][i]));
+
+    glm::vec4 pozice = texelFetch(si.textures[gbufferTexture+0], pixel);
+    outFragment.discard[i] = pozice.w == 0.f;
+    if(outFragment.discard[i])
+      continue;
+    glm::vec3 N = glm::vec3(texelFetch(si.textures[gbufferTexture+1], pixel));
+    glm::vec4 dC = texelFetch(si.textures[gbufferTexture+2], pixel);
+
+    auto L = glm::normalize(glm::vec3(pozice) - lightPosition);
+    float dF = glm::clamp(glm::dot(L,N),0.f,1.f);
+
+    for (uint32_t k = 0; k < 3; ++k)
+      outFragment.gl_FragColor.v[k][i] = dC[k] * ambientLightColor[k] + dC[k] * lightColor[k] * dF;
+    outFragment.gl_FragColor.v[3][i] = dC.a;
+  }
+}
+
+
+/// out = m * (in, w), prvnich outComponents slozek, po drahach davky
+static void transformBatch(AttributeBatch& out, glm::mat4 const& m, AttributeBatch const& in, float w, uint32_t outComponents){
+  for (uint32_t r = 0; r < outComponents; ++r)
+    for (uint32_t i = 0; i < shaderBatchSize; ++i)
+      out.v[r][i] = m[0][r]*in.v[0][i] + m[1][r]*in.v[1][i] + m[2][r]*in.v[2][i] + m[3][r]*w;
+}
+
+/**
+ * @brief This function represents batched vertex shader of texture rendering method (same output as drawModel_vertexShader).
+ *
+ * @param outVertex output vertices
+ * @param inVertex input vertices
+ * @param si shader interface
+ */
+//! [drawModel_vs_batch]
+void drawModel_vertexShaderBatch(OutVertexBatch&outVertex,InVertexBatch const&inVertex,ShaderInterface const&si){
+  // Konstanty DRAW, pokud je nevyplnil drawModel_prepare, spocitaji se pro davku
+  DrawModelConstants local;
+  auto c = (DrawModelConstants const*) izg_drawConstants(drawModel_prepare);
+  if(c == nullptr){
+    drawModel_prepareVertex(local, si);
+    c = &local;
+  }
+
+  transformBatch(outVertex.gl_Position, c->cameraModel, inVertex.attributes[0], 1.f, 4);
+  transformBatch(outVertex.attributes[0], c->model, inVertex.attributes[0], 1.f, 3); //pozice ve world space
+  transformBatch(outVertex.attributes[1], c->inverseTransposed, inVertex.attributes[1], 0.f, 3); //normala ve world space
+  outVertex.attributes[2] = inVertex.attributes[2]; //tex. koordinaty
+  transformBatch(outVertex.attributes[3], c->lightModel, inVertex.attributes[0], 1.f, 4);
+}
+//! [drawModel_vs_batch]
+
+/**
+ * @brief This function represents batched fragment shader of texture rendering method (same output as drawModel_fragmentShader).
+ *
+ * @param outFragment output fragments
+ * @param inFragment input fragments
+ * @param si shader interface
+ */
+//! [drawModel_fs_batch]
+void drawModel_fragmentShaderBatch(OutFragmentBatch&outFragment,InFragmentBatch const&inFragment,ShaderInterface const&si){
+  auto const& pozice = inFragment.attributes[0].v;
+  auto const& nor = inFragment.attributes[1].v;
+  auto const& UV = inFragment.attributes[2].v;
+
+  // Konstanty DRAW, pokud je nevyplnil drawModel_prepare, spocitaji se pro davku
+  DrawModelConstants local;
+  auto c = (DrawModelConstants const*) izg_drawConstants(drawModel_prepare);
+  if(c == nullptr){
+    drawModel_prepareFragment(local, si);
+    c = &local;
+  }
+  glm::vec3 lightPosition = c->lightPosition;
+  glm::vec3 ambientLightColor = c->ambientLightColor;
+  glm::vec3 lightColor = c->lightColor;
+
+  // textura nebo barva
+  float dC[4][shaderBatchSize];
+  for (uint32_t i = 0; i < shaderBatchSize; ++i){
+    glm::vec4 color = c->diffuseColor;
+    if(c->texture){
+      glm::vec4 dUVdx = glm::vec4(0.f), dUVdy = glm::vec4(0.f);
+      if(c->textureGradients){
+        glm::vec4 fragCoord = glm::vec4(inFragment.gl_FragCoord.v[0][i], inFragment.gl_FragCoord.v[1][i], inFragment.gl_FragCoord.v[2][i], 1.f);
+        izg_derivatives(2, fragCoord, dUVdx, dUVdy);
+      }
+      color = read_textureGrad(*c->texture, glm::vec2(UV[0][i], UV[1][i]), glm::vec2(dUVdx), glm::vec2(dUVdy));
+    }
+    for (uint32_t k = 0; k < 4; ++k)
+      dC[k][i] = color[k];
+  }
+
+  for (uint32_t i = 0; i < shaderBatchSize; ++i){
+    float n = 1.f / std::sqrt(nor[0][i]*nor[0][i] + nor[1][i]*nor[1][i] + nor[2][i]*nor[2][i]);
+    float lx = pozice[0][i] - lightPosition.x, ly = pozice[1][i] - lightPosition.y, lz = pozice[2][i] - lightPosition.z;
+    float l = 1.f / std::sqrt(lx*lx + ly*ly + lz*lz);
+    float dF = glm::clamp((lx*nor[0][i] + ly*nor[1][i] + lz*nor[2][i]) * l * n, 0.f, 1.f);
+
+    for (uint32_t k = 0; k < 3; ++k)
+      outFragment.gl_FragColor.v[k][i] = dC[k][i] * ambientLightColor[k] + dC[k][i] * lightColor[k] * dF;
+    outFragment.gl_FragColor.v[3][i] = dC[3][i];
+    outFragment.discard[i] = dC[3][i] < 0.5f;
+  }
+}
+//! [drawModel_fs_batch]
@@ -0,0 +1,223 @@
+/*!
+ * @file
+ * @brief This file contains batched shaders of model rendering and flattened scene draw list
+ */
+#pragma once
+
+#include <student/gpuExt.hpp>
+#include <student/prepareModel.hpp>
+
+#include <cmath>
+
+/**
+ * @brief Per-draw constants of texture rendering method (filled by drawModel_prepare)
+ */
+struct DrawModelConstants{
+  // vertex shader
+  glm::mat4      cameraModel;       ///< cameraProjectionView * model
+  glm::mat4      model;
+  glm::mat4      inverseTransposed; ///< inverzni transponovana modelova matice
+  glm::mat4      lightModel;        ///< lightProjectionView * model
+  // fragment shader
+  Texture const* texture;           ///< nullptr = pouziva se diffuseColor
+  bool           textureGradients;  ///< vyber mip urovne potrebuje derivace UV (izg_textureNeedsDerivatives)
+  glm::vec4      diffuseColor;
+  glm::vec3      lightPosition;
+  glm::vec3      cameraPosition;
+  glm::vec3      ambientLightColor;
+  glm::vec3      lightColor;
+  float          doubleSided;
+};
+
+static_assert(sizeof(DrawModelConstants) <= maxDrawConstants, "DrawModelConstants does not fit into constant block");
+
+/**
+ * @brief This function prepares per-draw constants of texture rendering method (ProgramSettings::prepare)
+ *
+ * prepareModel sets it to every program of the memory whose shader is drawModel_vertexShader or drawModel_fragmentShader
+ * and that has no prepare yet, the shaders use the block only if it was filled by this function.
+ *
+ * @param constants constant block of the draw
+ * @param si shader interface
+ */
+void drawModel_prepare(void*constants,ShaderInterface const&si);
+
+/**
+ * @brief This function represents batched vertex shader of texture rendering method
+ *
+ * @param outVertex output vertices
+ * @param inVertex input vertices
+ * @param si shader interface
+ */
+void drawModel_vertexShaderBatch(OutVertexBatch&outVertex,InVertexBatch const&inVertex,ShaderInterface const&si);
+
+/**
+ * @brief This function represents batched fragment shader of texture rendering method
+ *
+ * @param outFragment output fragments
+ * @param inFragment input fragments
+ * @param si shader interface
+ */
+void drawModel_fragmentShaderBatch(OutFragmentBatch&outFragment,InFragmentBatch const&inFragment,ShaderInterface const&si);
+
+/**
+ * @brief Node of flattened scene, nodes are stored in depth-first pre-order of Model::roots
+ */
+struct SceneNode{
+  int32_t   parent;     ///< index rodice, -1 = koren
+  uint32_t  end;        ///< index za poslednim uzlem podstromu
+  int32_t   mesh;       ///< Node::mesh
+  uint32_t  object;     ///< slot uniform objektu (jen pro mesh > -1)
+  glm::mat4 local;      ///< Node::modelMatrix
+  glm::mat4 world;      ///< soucin matic od korene
+  glm::mat4 normal;     ///< inverzni transponovana world
+};
+
+/**
+ * @brief Persistent draw list of a model: flattened nodes with cached matrices and draw records
+ *
+ * In the standard layout every node with a mesh is one object with its own VertexArray and DRAW, objects (and gl_DrawID)
+ * follow the pre-order of nodes. In the collapsed layout (multiDraw) every mesh is one MULTI_DRAW record whose instances
+ * are occurrences of the mesh, objects are ordered by mesh.
+ */
+struct SceneDrawList{
+  std::vector<SceneNode>   nodes;
+  std::vector<DrawRecord>  records;      ///< zaznam na objekt, ve slozenem rozlozeni na mesh (vyskyty meshe jsou instance)
+  std::vector<BoundingBox> meshBounds;   ///< box kazdeho meshe v jeho souradnicich (pocita se jednou pro model)
+  std::vector<CullNode>    cullNodes;    ///< hierarchie orezani MULTI_DRAW: 0 = cela scena, uzel n je cullNodes[n+1]
+  std::vector<uint8_t>     dirty;        ///< lokalni matice uzlu se zmenila od posledni aktualizace
+  bool                     multiDraw = false; ///< slozene rozlozeni (MULTI_DRAW s orezanim)
+
+  // Obsah, ze ktereho byl list pripraven: pri stejnem obsahu, pameti a nastaveni textur se list jen aktualizuje
+  std::vector<Mesh>     meshes  ; ///< meshe modelu, meshBounds je popisuji
+  std::vector<Buffer>   buffers ;
+  std::vector<Texture>  textures; ///< zdrojove textury modelu
+  std::vector<uint64_t> uploads ; ///< izg_textureUpload textur nahranych do pameti
+  GPUMemory const*      mem         = nullptr;
+  uint64_t              generation  = 0      ; ///< poradove cislo plne pripravy, 0 = nepripraven
+  TextureFilter         filter      = TextureFilter::NEAREST;
+  bool                  compression = false  ;
+};
+
+/**
+ * @brief This function prepares model like prepareModel, but into draw list owned by caller
+ *
+ * The list uses the collapsed layout if GPUSettings::multiDraw is set, the standard layout of prepareModel otherwise.
+ * A repeated call with a model of the same content (meshes, buffers, textures and tree of nodes) into the same memory,
+ * whose uploaded textures, buffers, vertex arrays and object uniforms still hold what the preparation wrote, only applies
+ * changed Node::modelMatrix and pushes the draw list. Data the buffers and textures point to are assumed unchanged;
+ * drawList = SceneDrawList() forces full preparation. prepareModel without a draw list always prepares everything.
+ *
+ * @param mem gpu memory
+ * @param commandBuffer command buffer
+ * @param model model
+ * @param drawList draw list, previous content is replaced
+ */
+void prepareModel(GPUMemory&mem,CommandBuffer&commandBuffer,Model const&model,SceneDrawList&drawList);
+
+/**
+ * @brief This function flattens model into draw list, fills vertex arrays and uniforms of all objects
+ *
+ * Boxes of meshes are computed only when the list was prepared from another model before.
+ *
+ * @param list draw list, previous content is replaced
+ * @param mem gpu memory
+ * @param model model
+ * @param multiDraw collapsed layout (one MULTI_DRAW record per mesh) instead of the standard one
+ */
+void prepareSceneDrawList(SceneDrawList&list,GPUMemory&mem,Model const&model,bool multiDraw);
+
+/**
+ * @brief This function changes local matrix of node, the change is applied by updateSceneDrawList
+ *
+ * @param list draw list
+ * @param node index of node (depth-first pre-order)
+ * @param modelMatrix new local matrix
+ */
+void setSceneNodeMatrix(SceneDrawList&list,uint32_t node,glm::mat4 const&modelMatrix);
+
+/**
+ * @brief This function recomputes matrices of changed subtrees and patches their uniform slots
+ *
+ * @param list draw list
+ * @param mem gpu memory
+ */
+void updateSceneDrawList(SceneDrawList&list,GPUMemory&mem);
+
+/**
+ * @brief This function appends draw list to command buffer: BIND_VERTEXARRAY and DRAW per object, or MULTI_DRAW of collapsed layout
+ *
+ * MULTI_DRAW records are copied when the command buffer is compiled, objects are culled by their boxes against camera
+ * uniforms[0] valid when the command buffer is executed.
+ *
+ * @param cb command buffer
+ * @param list draw list
+ */
+void pushSceneDrawList(CommandBuffer&cb,SceneDrawList const&list);
+
+/// Number of G-buffer render targets of deferred shading: world position (w = 1 covered), normal (w = object), albedo
+uint32_t const nofGBufferTargets = 3;
+
+/// Slots of gpu memory reserved by deferred shading of prepareModel (GPUSettings::deferredShading)
+uint32_t const deferredGeometryProgram = sizeof(GPUMemory::programs) / sizeof(Program) - 2;          ///< pruchod do G-bufferu
+uint32_t const deferredLightingProgram = sizeof(GPUMemory::programs) / sizeof(Program) - 1;          ///< pruchod osvetleni
+uint32_t const deferredLightingVertexArray = sizeof(GPUMemory::vertexArrays) / sizeof(VertexArray) - 1; ///< prazdny VertexArray trojuhelniku pres obrazovku
+uint32_t const gbufferTexture = sizeof(GPUMemory::textures) / sizeof(Texture) - nofGBufferTargets;  ///< prvni textura G-bufferu
+
+/**
+ * @brief This function prepares both programs of deferred shading, G-buffer textures are render targets of the geometry pass
+ *
+ * The G-buffer has the size of the framebuffer bound when the command buffer is executed.
+ * Translucent surfaces (alpha < 1) are blended only with the color cleared before the lighting pass, not with the geometry behind them.
+ * prepareModel falls back to forward shading if the model uses the reserved texture or vertex array slots,
+ * the fallback is counted in GPUStatistics::deferredFallbacks.
+ *
+ * @param mem gpu memory
+ */
+void prepareDeferredShading(GPUMemory&mem);
+
+/**
+ * @brief This function appends geometry pass of draw list and lighting pass over the whole framebuffer to command buffer
+ *
+ * The geometry pass starts with CLEAR_TARGETS of the G-buffer.
+ *
+ * @param cb command buffer
+ * @param list draw list
+ */
+void pushDeferredShading(CommandBuffer&cb,SceneDrawList const&list);
+
+/**
+ * @brief This function represents fragment shader of geometry pass, it writes surface into G-buffer (izg_fragmentOutput)
+ *
+ * @param outFragment output fragment (color is not written)
+ * @param inFragment input fragment
+ * @param si shader interface
+ */
+void drawModel_gbufferFragmentShader(OutFragment&outFragment,InFragment const&inFragment,ShaderInterface const&si);
+
+/**
+ * @brief This function represents vertex shader of lighting pass, gl_VertexID 0..2 form triangle covering the screen
+ *
+ * @param outVertex output vertex
+ * @param inVertex input vertex
+ * @param si shader interface
+ */
+void drawModel_lightingVertexShader(OutVertex&outVertex,InVertex const&inVertex,ShaderInterface const&si);
+
+/**
+ * @brief This function represents fragment shader of lighting pass, it lights surface stored in G-buffer at the pixel
+ *
+ * @param outFragment output fragment
+ * @param inFragment input fragment
+ * @param si shader interface
+ */
+void drawModel_lightingFragmentShader(OutFragment&outFragment,InFragment const&inFragment,ShaderInterface const&si);
+
+/**
+ * @brief This function represents batched fragment shader of lighting pass (same output as drawModel_lightingFragmentShader)
+ *
+ * @param outFragment output fragments
+ * @param inFragment input fragments
+ * @param si shader interface
+ */
+void drawModel_lightingFragmentShaderBatch(OutFragmentBatch&outFragment,InFragmentBatch const&inFragment,ShaderInterface const&si);
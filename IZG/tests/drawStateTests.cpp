@@ -0,0 +1,100 @@
+/*!
+ * @file
+ * @brief This file contains tests of shaders called directly, outside of any DRAW
+ *
+ * Build together with gpu.cpp and prepareModel.cpp, the program returns non-zero on failure.
+ */
+#include "triangleScene.hpp"
+
+#include <cstring>
+
+/// Po DRAW nesmi na vlakne zustat blok konstant ani trojuhelnik z rasterizace
+static void shadersAfterDraw(){
+  for (uint32_t binning = 0; binning < 2; ++binning){
+    izg_settings().binning = binning;
+
+    TriangleScene scene;
+    izg_enqueue(*scene.mem, *scene.cb);
+    CHECK(scene.color[(8 * 16 + 8) * 4 + 0] == 255);
+
+    CHECK(izg_drawConstants() == nullptr);
+    CHECK(izg_instanceID() == 0);
+
+    // Shader cte aktualni uniformy, ne konstanty DRAW
+    scene.mem->uniforms[10+2].v4 = glm::vec4(0.f, 1.f, 0.f, 1.f);
+    OutFragment out = scene.shade();
+    CHECK(out.gl_FragColor.r == 0.f);
+    CHECK(out.gl_FragColor.g == 1.f);
+  }
+  izg_settings() = GPUSettings();
+  izg_programSettings(0) = ProgramSettings();
+}
+
+/// Texturovany objekt stinovany mimo DRAW (mip urovne s trilinearni filtraci) cte uroven 0
+static void texturedShaderOutsideDraw(){
+  TriangleScene scene;
+
+  std::vector<uint8_t> texels(16 * 16 * 4);
+  for (uint32_t i = 0; i < 16 * 16; ++i){
+    texels[i*4+0] = 0;
+    texels[i*4+1] = 0;
+    texels[i*4+2] = 255;
+    texels[i*4+3] = 255;
+  }
+  Texture texture;
+  texture.img.data = texels.data();
+  texture.img.pitch = 16 * 4;
+  texture.img.bytesPerPixel = 4;
+  texture.img.channels = 4;
+  texture.width = texture.height = 16;
+  izg_uploadTexture(*scene.mem, 0, texture, TextureFilter::TRILINEAR, false);
+  CHECK(izg_textureNeedsDerivatives(scene.mem->textures[0]));
+  scene.mem->uniforms[10+3].i1 = 0;
+
+  OutFragment out = scene.shade();
+  CHECK(out.gl_FragColor.b == 1.f);
+  CHECK(!out.discard);
+
+  // Po DRAW se stejna textura cte z vysledku rasterizace
+  izg_enqueue(*scene.mem, *scene.cb);
+  CHECK(scene.color[(8 * 16 + 8) * 4 + 2] == 255);
+  out = scene.shade();
+  CHECK(out.gl_FragColor.b == 1.f);
+  izg_programSettings(0) = ProgramSettings();
+}
+
+/// Blok konstant, ktery vyplnil jiny prepare nez drawModel_prepare, shadery drawModel nectou
+static void foreignConstantsIgnored(){
+  TriangleScene scene;
+  izg_programSettings(0).prepare = [](void* constants, ShaderInterface const&){ std::memset(constants, 0xff, maxDrawConstants); };
+  izg_enqueue(*scene.mem, *scene.cb);
+  CHECK(scene.color[(8 * 16 + 8) * 4 + 0] == 255);
+  CHECK(scene.color[(8 * 16 + 8) * 4 + 1] == 0);
+  izg_programSettings(0) = ProgramSettings();
+}
+
+/// Textura sestavena aplikaci (pitch 0 = vsechny radky stejne) neni nahrana, cte se jako obraz
+static void handBuiltTextureNotUploaded(){
+  uint8_t row[4 * 4] = {};
+  for (uint32_t x = 0; x < 4; ++x)
+    row[x*4+1] = row[x*4+3] = 255;
+  Texture texture;
+  texture.img.data = row;
+  texture.img.pitch = 0;
+  texture.img.bytesPerPixel = 4;
+  texture.img.channels = 4;
+  texture.width = texture.height = 4;
+  CHECK(!izg_textureNeedsDerivatives(texture));
+  CHECK(read_textureLod(texture, glm::vec2(0.5f), 1.f).g == 1.f);
+}
+
+int main(){
+  texturedShaderOutsideDraw();
+  handBuiltTextureNotUploaded();
+  shadersAfterDraw();
+  foreignConstantsIgnored();
+
+  if(failures)
+    std::printf("%u checks failed\n", failures);
+  return failures ? 1 : 0;
+}
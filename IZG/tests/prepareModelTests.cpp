@@ -0,0 +1,352 @@
+/*!
+ * @file
+ * @brief This file contains tests of prepareModel with several models
+ *
+ * Build together with gpu.cpp and prepareModel.cpp, the program returns non-zero on failure.
+ */
+#include "triangleScene.hpp"
+
+#include <cstring>
+
+/// Model s jednim meshem trojuhelniku sceny (nofIndices 0 = nic nekresli)
+static Model triangleModel(TriangleScene const& scene, uint32_t nofIndices, glm::vec4 const& color){
+  Model model;
+  Buffer buffer;
+  buffer.data = scene.vertices.data();
+  buffer.size = scene.vertices.size() * sizeof(float);
+  model.buffers.push_back(buffer);
+
+  Mesh mesh;
+  mesh.position = scene.mem->vertexArrays[0].vertexAttrib[0];
+  mesh.normal   = scene.mem->vertexArrays[0].vertexAttrib[1];
+  mesh.texCoord = scene.mem->vertexArrays[0].vertexAttrib[2];
+  mesh.nofIndices = nofIndices;
+  mesh.diffuseColor = color;
+  mesh.doubleSided = true;
+  model.meshes.push_back(mesh);
+
+  Node node;
+  node.mesh = 0;
+  model.roots.push_back(node);
+  return model;
+}
+
+/// Command buffer: framebuffer, program 0, CLEAR a prikazy modelu
+static std::unique_ptr<CommandBuffer> frameCommands(CommandBuffer& modelCommands, uint32_t framebuffer = 0){
+  auto cb = std::make_unique<CommandBuffer>();
+  auto& c = cb->commands;
+  uint32_t& n = cb->nofCommands;
+  c[n].type = CommandType::BIND_FRAMEBUFFER; c[n++].data.bindFramebufferCommand.id = framebuffer;
+  c[n].type = CommandType::BIND_PROGRAM;     c[n++].data.bindProgramCommand.id = 0;
+  c[n].type = CommandType::CLEAR;            c[n++].data.clearCommand = ClearCommand();
+  c[n].type = CommandType::SUB_COMMAND;      c[n++].data.subCommand.commandBuffer = &modelCommands;
+  return cb;
+}
+
+/// Command buffer drivejsiho modelu kresli jeho zaznamy i po prepareModel dalsiho modelu
+static void modelsKeepTheirDrawLists(){
+  TriangleScene first, second;
+  Model firstModel  = triangleModel(first , 3, glm::vec4(1.f, 0.f, 0.f, 1.f));
+  Model secondModel = triangleModel(second, 0, glm::vec4(0.f, 1.f, 0.f, 1.f));
+
+  auto firstCommands  = std::make_unique<CommandBuffer>();
+  auto secondCommands = std::make_unique<CommandBuffer>();
+  prepareModel(*first .mem, *firstCommands , firstModel );
+  prepareModel(*second.mem, *secondCommands, secondModel);
+
+  izg_enqueue(*first.mem, *frameCommands(*firstCommands));
+  CHECK(first.color[(8 * 16 + 8) * 4 + 0] == 255);
+
+  // Draw list vlastneny volajicim
+  SceneDrawList list;
+  auto ownCommands = std::make_unique<CommandBuffer>();
+  prepareModel(*second.mem, *ownCommands, firstModel, list);
+  CHECK(list.records.size() == 1 && list.records[0].nofVertices == 3);
+  izg_enqueue(*second.mem, *frameCommands(*ownCommands));
+  CHECK(second.color[(8 * 16 + 8) * 4 + 0] == 255);
+  izg_programSettings(0) = ProgramSettings();
+}
+
+/// prepareModel nastavi drawModel_prepare programum se shadery drawModel, ostatnim ne
+static void prepareRegistered(){
+  TriangleScene scene;
+  izg_programSettings(0) = ProgramSettings();
+  Model model = triangleModel(scene, 3, glm::vec4(1.f));
+  auto commands = std::make_unique<CommandBuffer>();
+  prepareModel(*scene.mem, *commands, model);
+  CHECK(izg_programSettings(0).prepare == drawModel_prepare);
+  CHECK(izg_programSettings(1).prepare == nullptr);
+  izg_programSettings(0) = ProgramSettings();
+}
+
+/// Opakovany prepareModel stejneho modelu jen prenese zmenene matice, textury se znovu nenahravaji
+static void repeatedPrepareUpdatesMatrices(){
+  TriangleScene scene;
+  Model model = triangleModel(scene, 3, glm::vec4(1.f));
+  std::vector<uint8_t> texels(4 * 4 * 4, 255);
+  Texture texture;
+  texture.img.data = texels.data();
+  texture.img.pitch = 4 * 4;
+  texture.width = texture.height = 4;
+  model.textures.push_back(texture);
+
+  SceneDrawList list;
+  auto commands = std::make_unique<CommandBuffer>();
+  prepareModel(*scene.mem, *commands, model, list);
+  void const* uploaded = scene.mem->textures[0].img.data;
+  uint64_t generation = list.generation;
+
+  model.roots[0].modelMatrix[3] = glm::vec4(0.5f, 0.f, 0.f, 1.f);
+  commands->nofCommands = 0;
+  prepareModel(*scene.mem, *commands, model, list);
+  CHECK(list.generation == generation);
+  CHECK(scene.mem->textures[0].img.data == uploaded);
+  CHECK(scene.mem->uniforms[10+0].m4[3].x == 0.5f);
+  CHECK(commands->nofCommands == 2);
+
+  // Jiny model v teze pameti: dalsi prepareModel musi pripravit vse znovu
+  SceneDrawList other;
+  Model otherModel = triangleModel(scene, 3, glm::vec4(0.f));
+  prepareModel(*scene.mem, *commands, otherModel, other);
+  prepareModel(*scene.mem, *commands, model, list);
+  CHECK(list.generation != generation);
+  CHECK(scene.mem->uniforms[10+2].v4.x == 1.f);
+
+  // Stejny objekt Model se zmenenym obsahem se pripravi znovu
+  generation = list.generation;
+  model.meshes[0].diffuseColor = glm::vec4(0.5f);
+  prepareModel(*scene.mem, *commands, model, list);
+  CHECK(list.generation != generation);
+  CHECK(scene.mem->uniforms[10+2].v4.x == 0.5f);
+
+  // Plny prepareModel bez listu pripravi vse vzdy
+  scene.mem->uniforms[10+2].v4 = glm::vec4(0.f);
+  prepareModel(*scene.mem, *commands, model);
+  CHECK(scene.mem->uniforms[10+2].v4.x == 0.5f);
+}
+
+/// Standardni rozlozeni: uzly v pre-order poradi, kazdy s vlastnim VertexArray, DRAW a uniformami 10+gl_DrawID*5
+static void standardLayout(){
+  TriangleScene scene;
+  Model model = triangleModel(scene, 3, glm::vec4(1.f, 0.f, 0.f, 1.f));
+  Node child = model.roots[0];
+  child.modelMatrix[3] = glm::vec4(0.25f, 0.f, 0.f, 1.f);
+  model.roots[0].children.push_back(child);
+  model.roots.push_back(child);
+
+  // Plny prepareModel nastaveni slozeneho rozlozeni ignoruje
+  izg_settings().multiDraw = true;
+  auto commands = std::make_unique<CommandBuffer>();
+  prepareModel(*scene.mem, *commands, model);
+  izg_settings() = GPUSettings();
+
+  CHECK(commands->nofCommands == 6);
+  for (uint32_t d = 0; d < 3; ++d){
+    CHECK(commands->commands[2*d+0].type == CommandType::BIND_VERTEXARRAY);
+    CHECK(commands->commands[2*d+0].data.bindVertexArrayCommand.id == d);
+    CHECK(commands->commands[2*d+1].type == CommandType::DRAW);
+    CHECK(commands->commands[2*d+1].data.drawCommand.nofVertices == 3);
+    CHECK(scene.mem->uniforms[10+d*5+2].v4.x == 1.f);
+  }
+  CHECK(scene.mem->uniforms[10+0*5+0].m4[3].x == 0.f);
+  CHECK(scene.mem->uniforms[10+1*5+0].m4[3].x == 0.25f);
+  CHECK(scene.mem->uniforms[10+2*5+0].m4[3].x == 0.25f);
+
+  izg_enqueue(*scene.mem, *frameCommands(*commands));
+  CHECK(scene.color[(8 * 16 + 8) * 4 + 0] == 255);
+  izg_programSettings(0) = ProgramSettings();
+}
+
+/// Orezani slozeneho rozlozeni pouziva kameru platnou pri provadeni, ne pri prepareModel
+static void cullingUsesCurrentCamera(){
+  TriangleScene scene;
+  Model model = triangleModel(scene, 3, glm::vec4(1.f, 0.f, 0.f, 1.f));
+  izg_settings().multiDraw = true;
+  SceneDrawList list;
+  auto commands = std::make_unique<CommandBuffer>();
+  prepareModel(*scene.mem, *commands, model, list);
+  izg_settings() = GPUSettings();
+  CHECK(commands->nofCommands == 1 && commands->commands[0].type == MULTI_DRAW);
+  auto frame = frameCommands(*commands);
+
+  // Kamera posunuta tak, ze je trojuhelnik cely vpravo mimo frustum
+  glm::mat4 away = glm::mat4(1.f);
+  away[3] = glm::vec4(5.f, 0.f, 0.f, 1.f);
+  scene.mem->uniforms[0].m4 = away;
+  uint64_t culled = izg_statistics().instancesCulled;
+  izg_enqueue(*scene.mem, *frame);
+  CHECK(izg_statistics().instancesCulled == culled + 1);
+  CHECK(scene.color[(8 * 16 + 8) * 4 + 0] == 0);
+
+  scene.mem->uniforms[0].m4 = glm::mat4(1.f);
+  izg_enqueue(*scene.mem, *frame);
+  CHECK(izg_statistics().instancesCulled == culled + 1);
+  CHECK(scene.color[(8 * 16 + 8) * 4 + 0] == 255);
+  izg_programSettings(0) = ProgramSettings();
+}
+
+/// Hierarchie orezani: uzel mimo frustum nezahodi potomka uvnitr, podstrom cely venku se oreze cely
+static void subtreeCulling(){
+  TriangleScene scene;
+  Model model = triangleModel(scene, 3, glm::vec4(1.f, 0.f, 0.f, 1.f));
+  Node& root = model.roots[0];
+  root.modelMatrix[3] = glm::vec4(5.f, 0.f, 0.f, 1.f);
+  Node inside, outside;
+  inside.mesh = outside.mesh = 0;
+  inside.modelMatrix[3] = glm::vec4(-5.f, 0.f, 0.f, 1.f);
+  root.children.push_back(inside);
+  root.children.push_back(outside);
+
+  izg_settings().multiDraw = true;
+  SceneDrawList list;
+  auto commands = std::make_unique<CommandBuffer>();
+  prepareModel(*scene.mem, *commands, model, list);
+  izg_settings() = GPUSettings();
+  CHECK(list.cullNodes.size() == 4 && list.cullNodes[0].end == 4 && list.cullNodes[1].end == 4);
+  auto frame = frameCommands(*commands);
+
+  uint64_t culled = izg_statistics().instancesCulled;
+  izg_enqueue(*scene.mem, *frame);
+  CHECK(izg_statistics().instancesCulled == culled + 2);
+  CHECK(scene.color[(8 * 16 + 8) * 4 + 0] == 255);
+
+  // Kamera posunuta tak, ze je cela scena mimo frustum
+  glm::mat4 away = glm::mat4(1.f);
+  away[3] = glm::vec4(-20.f, 0.f, 0.f, 1.f);
+  scene.mem->uniforms[0].m4 = away;
+  std::memset(scene.color.data(), 0, scene.color.size());
+  izg_enqueue(*scene.mem, *frame);
+  CHECK(izg_statistics().instancesCulled == culled + 5);
+  CHECK(scene.color[(8 * 16 + 8) * 4 + 0] == 0);
+  izg_programSettings(0) = ProgramSettings();
+}
+
+/// G-buffer odlozeneho stinovani ma velikost framebufferu, do ktereho se kresli pri provadeni
+static void deferredFollowsFramebuffer(){
+  TriangleScene scene;
+  Model model = triangleModel(scene, 3, glm::vec4(1.f, 0.5f, 0.f, 1.f));
+  auto commands = std::make_unique<CommandBuffer>();
+  prepareModel(*scene.mem, *commands, model);
+  izg_enqueue(*scene.mem, *frameCommands(*commands));
+  uint8_t forward[4];
+  std::memcpy(forward, &scene.color[(8 * 16 + 8) * 4], 4);
+  CHECK(forward[0] == 255);
+
+  izg_settings().deferredShading = true;
+  commands->nofCommands = 0;
+  prepareModel(*scene.mem, *commands, model);
+  auto frame = frameCommands(*commands);
+  std::memset(scene.color.data(), 0, scene.color.size());
+  izg_enqueue(*scene.mem, *frame);
+  CHECK(std::memcmp(forward, &scene.color[(8 * 16 + 8) * 4], 4) == 0);
+
+  // Zvetseny framebuffer bez nove pripravy modelu
+  std::vector<uint8_t> color(32 * 32 * 4);
+  std::vector<float>   depth(32 * 32);
+  Framebuffer& fb = scene.mem->framebuffers[0];
+  fb.width = fb.height = 32;
+  fb.color.data = color.data();
+  fb.color.pitch = 32 * 4;
+  fb.depth.data = depth.data();
+  fb.depth.pitch = 32 * sizeof(float);
+  izg_enqueue(*scene.mem, *frame);
+  CHECK(scene.mem->textures[gbufferTexture].width == 32);
+  CHECK(std::memcmp(forward, &color[(16 * 32 + 16) * 4], 4) == 0);
+  CHECK(std::memcmp(forward, &color[(31 * 32 + 1) * 4], 4) == 0);
+
+  // Jiny framebuffer puvodni velikosti
+  std::vector<uint8_t> otherColor(16 * 16 * 4);
+  std::vector<float>   otherDepth(16 * 16);
+  Framebuffer& other = scene.mem->framebuffers[1];
+  other = fb;
+  other.width = other.height = 16;
+  other.color.data = otherColor.data();
+  other.color.pitch = 16 * 4;
+  other.depth.data = otherDepth.data();
+  other.depth.pitch = 16 * sizeof(float);
+  izg_enqueue(*scene.mem, *frameCommands(*commands, 1));
+  CHECK(scene.mem->textures[gbufferTexture].width == 16);
+  CHECK(std::memcmp(forward, &otherColor[(8 * 16 + 8) * 4], 4) == 0);
+
+  izg_settings() = GPUSettings();
+  izg_programSettings(0) = ProgramSettings();
+  izg_programSettings(deferredGeometryProgram) = ProgramSettings();
+  izg_programSettings(deferredLightingProgram) = ProgramSettings();
+}
+
+/// CLEAR necisti render targety, CLEAR_TARGETS jen ty aktivovaneho programu
+static void clearTargetsOfBoundProgram(){
+  TriangleScene scene;
+  Model model = triangleModel(scene, 3, glm::vec4(1.f, 0.5f, 0.f, 1.f));
+  izg_settings().deferredShading = true;
+  auto commands = std::make_unique<CommandBuffer>();
+  prepareModel(*scene.mem, *commands, model);
+  izg_enqueue(*scene.mem, *frameCommands(*commands));
+  auto position = [&](){ return ((glm::vec4 const*) scene.mem->textures[gbufferTexture].img.data)[8 * 16 + 8]; };
+  CHECK(position().w == 1.f);
+
+  // Program 0 bez render targetu: CLEAR i CLEAR_TARGETS nechaji G-buffer
+  auto clears = std::make_unique<CommandBuffer>();
+  auto& c = clears->commands;
+  uint32_t& n = clears->nofCommands;
+  c[n].type = CommandType::BIND_FRAMEBUFFER; c[n++].data.bindFramebufferCommand.id = 0;
+  c[n].type = CommandType::BIND_PROGRAM;     c[n++].data.bindProgramCommand.id = 0;
+  c[n].type = CommandType::CLEAR;            c[n++].data.clearCommand = ClearCommand();
+  izg_pushCommand(*clears, CLEAR_TARGETS, ClearTargetsCommand());
+  izg_enqueue(*scene.mem, *clears);
+  CHECK(position().w == 1.f);
+
+  // Pruchod geometrie vyplni sve render targety zadanou hodnotou
+  ClearTargetsCommand fill;
+  fill.value = glm::vec4(2.f);
+  n = 0;
+  c[n].type = CommandType::BIND_PROGRAM; c[n++].data.bindProgramCommand.id = deferredGeometryProgram;
+  izg_pushCommand(*clears, CLEAR_TARGETS, fill);
+  izg_enqueue(*scene.mem, *clears);
+  CHECK(position() == glm::vec4(2.f));
+  CHECK(((glm::vec4 const*) scene.mem->textures[gbufferTexture+2].img.data)[0] == glm::vec4(2.f));
+
+  izg_settings() = GPUSettings();
+  izg_programSettings(0) = ProgramSettings();
+  izg_programSettings(deferredGeometryProgram) = ProgramSettings();
+  izg_programSettings(deferredLightingProgram) = ProgramSettings();
+}
+
+/// Model pouzivajici vyhrazeny VertexArray se kresli dopredne a pocita se do statistik
+static void deferredFallbackCounted(){
+  TriangleScene scene;
+  Model model = triangleModel(scene, 3, glm::vec4(1.f));
+  izg_settings().deferredShading = true;
+  uint64_t fallbacks = izg_statistics().deferredFallbacks;
+  auto commands = std::make_unique<CommandBuffer>();
+  prepareModel(*scene.mem, *commands, model);
+  CHECK(izg_statistics().deferredFallbacks == fallbacks);
+
+  model.roots.resize(deferredLightingVertexArray + 1, model.roots[0]);
+  commands->nofCommands = 0;
+  prepareModel(*scene.mem, *commands, model);
+  CHECK(izg_statistics().deferredFallbacks == fallbacks + 1);
+  for (uint32_t i = 0; i < commands->nofCommands; ++i)
+    CHECK(commands->commands[i].type != CommandType::BIND_PROGRAM);
+
+  izg_settings() = GPUSettings();
+  izg_programSettings(0) = ProgramSettings();
+  izg_programSettings(deferredGeometryProgram) = ProgramSettings();
+  izg_programSettings(deferredLightingProgram) = ProgramSettings();
+}
+
+int main(){
+  modelsKeepTheirDrawLists();
+  prepareRegistered();
+  repeatedPrepareUpdatesMatrices();
+  standardLayout();
+  cullingUsesCurrentCamera();
+  subtreeCulling();
+  deferredFollowsFramebuffer();
+  clearTargetsOfBoundProgram();
+  deferredFallbackCounted();
+
+  if(failures)
+    std::printf("%u checks failed\n", failures);
+  return failures ? 1 : 0;
+}
@@ -0,0 +1,120 @@
+/*!
+ * @file
+ * @brief This file contains tests of asynchronous submission (izg_submit) overlapped with changes of GPUMemory
+ *
+ * Build together with gpu.cpp and prepareModel.cpp, the program returns non-zero on failure.
+ */
+#include "triangleScene.hpp"
+
+/// Nahrani jednobarevne textury 64x64 do slotu id
+static void uploadColor(GPUMemory& mem, uint32_t id, uint8_t r, uint8_t g, uint8_t b){
+  std::vector<uint8_t> texels(64 * 64 * 4);
+  for (uint32_t i = 0; i < 64 * 64; ++i){
+    texels[i*4+0] = r;
+    texels[i*4+1] = g;
+    texels[i*4+2] = b;
+    texels[i*4+3] = 255;
+  }
+  Texture texture;
+  texture.img.data = texels.data();
+  texture.img.pitch = 64 * 4;
+  texture.img.bytesPerPixel = 4;
+  texture.img.channels = 4;
+  texture.width = texture.height = 64;
+  izg_uploadTexture(mem, id, texture, TextureFilter::BILINEAR, false);
+}
+
+/// Po izg_submit se smi prepsat uniformy i textura, odeslany command buffer kresli s puvodnimi
+static void changesAfterSubmit(bool uniformLayout){
+  TriangleScene scene;
+  if(uniformLayout){
+    // Kopiruji se jen uniformy sceny a objektu
+    izg_programSettings(0).nofUniforms = 10;
+    izg_programSettings(0).uniformsPerDraw = 5;
+  }
+  uploadColor(*scene.mem, 0, 255, 0, 0);
+  scene.mem->uniforms[10+3].i1 = 0;
+
+  for (uint32_t frame = 0; frame < 8; ++frame){
+    GPUFence fence = izg_submit(*scene.mem, *scene.cb);
+
+    // Dalsi snimek se pripravuje, zatimco se tento kresli
+    bool red = frame % 2 == 0;
+    uploadColor(*scene.mem, 0, red ? 0 : 255, 0, red ? 255 : 0);
+    scene.mem->uniforms[10+2].v4 = glm::vec4(0.5f);
+
+    izg_wait(fence);
+    CHECK(scene.color[(8 * 16 + 8) * 4 + 0] == (red ? 255 : 0));
+    CHECK(scene.color[(8 * 16 + 8) * 4 + 2] == (red ? 0 : 255));
+    scene.mem->uniforms[10+2].v4 = glm::vec4(1.f);
+  }
+  izg_finish();
+  izg_programSettings(0) = ProgramSettings();
+}
+
+/// Vazby odeslaneho command bufferu plati pro dalsi odeslani a po izg_finish jsou v pameti
+static void bindingsAcrossSubmits(){
+  TriangleScene scene;
+  std::vector<uint8_t> color(16 * 16 * 4);
+  scene.mem->framebuffers[1] = scene.mem->framebuffers[0];
+  scene.mem->framebuffers[1].color.data = color.data();
+  scene.mem->framebuffers[1].depth.data = nullptr;
+
+  auto bindFramebuffer = std::make_unique<CommandBuffer>();
+  bindFramebuffer->commands[0].type = CommandType::BIND_FRAMEBUFFER;
+  bindFramebuffer->commands[0].data.bindFramebufferCommand.id = 1;
+  bindFramebuffer->nofCommands = 1;
+
+  auto clear = std::make_unique<CommandBuffer>();
+  clear->commands[0].type = CommandType::CLEAR;
+  clear->commands[0].data.clearCommand = ClearCommand();
+  clear->commands[0].data.clearCommand.color = glm::vec4(0.f, 1.f, 0.f, 1.f);
+  clear->commands[0].data.clearCommand.clearDepth = false;
+  clear->nofCommands = 1;
+
+  izg_submit(*scene.mem, *bindFramebuffer);
+  CHECK(scene.mem->activatedFramebuffer == 0);
+  izg_wait(izg_submit(*scene.mem, *clear));
+  CHECK(color[1] == 255);
+  CHECK(scene.color[1] == 0);
+
+  izg_finish();
+  CHECK(scene.mem->activatedFramebuffer == 1);
+}
+
+/// Textura se stejnym id nahrana do jine pameti neuvolni texturu prvni pameti
+static void texturesPerMemory(){
+  TriangleScene first, second;
+  uploadColor(*first .mem, 0, 255, 0, 0);
+  uploadColor(*second.mem, 0, 0, 0, 255);
+  izg_finish();
+  CHECK(read_textureLod(first.mem->textures[0], glm::vec2(0.5f), 0.f).x == 1.f);
+  CHECK(read_textureLod(second.mem->textures[0], glm::vec2(0.5f), 0.f).z == 1.f);
+
+  izg_releaseTextures(*first.mem);
+  CHECK(first.mem->textures[0].img.data == nullptr);
+  CHECK(second.mem->textures[0].img.data != nullptr);
+  izg_releaseTextures(*second.mem);
+}
+
+/// Pocitadla odeslani se do statistik aplikace prevezmou po signalizaci fence
+static void statisticsAfterFence(){
+  TriangleScene scene;
+  uint64_t invocations = izg_statistics().vertexShaderInvocations;
+  izg_wait(izg_submit(*scene.mem, *scene.cb));
+  CHECK(izg_statistics().vertexShaderInvocations == invocations + 3);
+  izg_finish();
+  izg_programSettings(0) = ProgramSettings();
+}
+
+int main(){
+  changesAfterSubmit(false);
+  changesAfterSubmit(true);
+  bindingsAcrossSubmits();
+  texturesPerMemory();
+  statisticsAfterFence();
+
+  if(failures)
+    std::printf("%u checks failed\n", failures);
+  return failures ? 1 : 0;
+}
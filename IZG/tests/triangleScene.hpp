@@ -0,0 +1,105 @@
+/*!
+ * @file
+ * @brief This file contains small scene shared by tests: one triangle of object 0 over 16x16 framebuffer
+ */
+#pragma once
+
+#include <student/gpu.hpp>
+#include <student/gpuExt.hpp>
+#include <student/prepareModel.hpp>
+#include <student/prepareModelExt.hpp>
+
+#include <cstdio>
+#include <memory>
+#include <vector>
+
+inline uint32_t failures = 0;
+
+#define CHECK(condition) do{ if(!(condition)){ std::printf("%s:%d: CHECK(%s) failed\n", __FILE__, __LINE__, #condition); ++failures; } }while(0)
+
+/// Jeden trojuhelnik objektu 0 pres cely framebuffer
+struct TriangleScene{
+  std::vector<uint8_t> color;
+  std::vector<float>   depth;
+  std::vector<float>   vertices;
+  std::unique_ptr<GPUMemory>     mem = std::make_unique<GPUMemory>();
+  std::unique_ptr<CommandBuffer> cb  = std::make_unique<CommandBuffer>();
+
+  TriangleScene(){
+    uint32_t const size = 16;
+    color.resize(size * size * 4);
+    depth.resize(size * size);
+
+    Framebuffer& fb = mem->framebuffers[0];
+    fb.width = fb.height = size;
+    fb.color.data = color.data();
+    fb.color.pitch = size * 4;
+    fb.color.bytesPerPixel = 4;
+    fb.color.channels = 4;
+    fb.depth.data = depth.data();
+    fb.depth.pitch = size * sizeof(float);
+    fb.depth.bytesPerPixel = sizeof(float);
+    fb.depth.channels = 1;
+    fb.depth.format = Image::FLOAT32;
+
+    // pozice, normala, uv
+    vertices = {-1,-1,0, 0,0,1, 0,0,
+                 3,-1,0, 0,0,1, 1,0,
+                -1, 3,0, 0,0,1, 0,1};
+    mem->buffers[0].data = vertices.data();
+    mem->buffers[0].size = vertices.size() * sizeof(float);
+
+    VertexArray& va = mem->vertexArrays[0];
+    for (uint32_t a = 0; a < 3; ++a){
+      va.vertexAttrib[a].bufferID = 0;
+      va.vertexAttrib[a].stride = 8 * sizeof(float);
+      va.vertexAttrib[a].offset = (a == 0 ? 0 : a == 1 ? 3 : 6) * sizeof(float);
+      va.vertexAttrib[a].type = a == 2 ? AttributeType::VEC2 : AttributeType::VEC3;
+    }
+
+    Program& prg = mem->programs[0];
+    prg.vertexShader = drawModel_vertexShader;
+    prg.fragmentShader = drawModel_fragmentShader;
+    prg.vs2fs[0] = AttributeType::VEC3;
+    prg.vs2fs[1] = AttributeType::VEC3;
+    prg.vs2fs[2] = AttributeType::VEC2;
+    izg_programSettings(0).prepare = drawModel_prepare;
+
+    glm::mat4 identity = glm::mat4(1.f);
+    mem->uniforms[0].m4 = identity;
+    mem->uniforms[1].v3 = glm::vec3(0.f, 0.f, -1.f);
+    mem->uniforms[7].v3 = glm::vec3(1.f);
+    mem->uniforms[8].v3 = glm::vec3(0.f);
+    mem->uniforms[10+0].m4 = identity;
+    mem->uniforms[10+1].m4 = identity;
+    mem->uniforms[10+2].v4 = glm::vec4(1.f, 0.f, 0.f, 1.f);
+    mem->uniforms[10+3].i1 = -1;
+    mem->uniforms[10+4].v1 = 0.f;
+
+    auto& c = cb->commands;
+    uint32_t& n = cb->nofCommands;
+    c[n].type = CommandType::BIND_FRAMEBUFFER; c[n++].data.bindFramebufferCommand.id = 0;
+    c[n].type = CommandType::BIND_PROGRAM;     c[n++].data.bindProgramCommand.id = 0;
+    c[n].type = CommandType::BIND_VERTEXARRAY; c[n++].data.bindVertexArrayCommand.id = 0;
+    c[n].type = CommandType::CLEAR;            c[n++].data.clearCommand = ClearCommand();
+    c[n].type = CommandType::DRAW;             c[n++].data.drawCommand.nofVertices = 3;
+  }
+
+  /// Fragment shader objektu 0 zavolany primo, se stejnymi uniformami jako DRAW
+  OutFragment shade() const {
+    ShaderInterface si;
+    si.uniforms = mem->uniforms;
+    si.textures = mem->textures;
+    si.gl_DrawID = 0;
+
+    InFragment in;
+    in.gl_FragCoord = glm::vec4(8.5f, 8.5f, 0.f, 1.f);
+    in.attributes[0].v3 = glm::vec3(0.f);
+    in.attributes[1].v3 = glm::vec3(0.f, 0.f, 1.f);
+    in.attributes[2].v2 = glm::vec2(0.5f);
+
+    OutFragment out;
+    drawModel_fragmentShader(out, in, si);
+    return out;
+  }
+};